@@ -0,0 +1,260 @@
+#ifndef BATCH_SCHEDULER_H
+#define BATCH_SCHEDULER_H
+
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include "cancellation.h"
+#include "mpmc_queue.h"
+
+// Continuous batching for token generation. One scheduler thread runs generation steps over
+// every active request at once; requests submitted meanwhile join the batch at the next step
+// instead of waiting for the current batch to finish, and finished ones leave it right away.
+// Submitted requests reach the scheduler thread through a lock-free ring (MpmcQueue), which it
+// drains in one batch at every step boundary and sleeps on when there is nothing to run, so
+// submitting never contends with the step loop for a lock.
+//
+// Waiting requests are admitted by priority, then earliest deadline (EDF), then arrival. When
+// the batch is full and a waiting request has a higher priority than the lowest-priority
+// running one, that one is preempted at the step boundary and waits again with the tokens it
+// has generated so far; it resumes where it stopped once it is the best candidate again. A
+// step only depends on each sequence's tokens, so nothing else has to be saved.
+//
+// A request whose CancellationToken is cancelled (its client went away, its time budget ran
+// out) is dropped at the next step boundary, running or waiting; its token budget is
+// maxNewTokens. The step itself serves the whole batch, so it is never cut short for one
+// request. Requests for different model adapters share the batch: the step gets each
+// sequence's adapter and serves them all in one pass. A step that throws fails the requests
+// of its batch (Event::Failed) and the scheduler goes on with the next one.
+class BatchScheduler {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum class Event {
+        Token,     // a generated token, more to come
+        Finished,  // the last token (tokenId -1 if the request had nothing to generate)
+        Cancelled, // dropped before finishing (tokenId -1)
+        Failed     // the step of its batch threw (tokenId -1)
+    };
+
+    // Called on the scheduler thread for every generated token; the last call is Finished,
+    // Cancelled or Failed
+    typedef std::function<void(int tokenId, Event event)> TokenCallback;
+
+    // One generation step: the next token id for each sequence of the batch, each under the
+    // model adapter of its request (adapters[i] for sequences[i])
+    typedef std::function<std::vector<int>(const std::vector<std::vector<int>>& sequences,
+                                           const std::vector<int>& adapters)> StepFunction;
+
+    struct Request {
+        std::vector<int> tokenIds;
+        int maxNewTokens = 1;
+        TokenCallback onToken;
+        int priority = 0;                            // higher runs first (e.g. interactive over batch)
+        Clock::time_point deadline = Clock::time_point::max(); // orders requests of equal priority
+        CancellationToken cancel; // e.g. CancellationToken::withBudget() for a time budget
+        int adapter = -1;         // model adapter to generate with (-1: the base model)
+    };
+
+    struct Stats {
+        uint64_t steps = 0;
+        uint64_t tokens = 0;
+        uint64_t completed = 0;
+        uint64_t preemptions = 0;
+        uint64_t cancelled = 0;
+        uint64_t failed = 0;
+    };
+
+private:
+    struct Active {
+        Request request;
+        int generated;
+        uint64_t arrival;
+    };
+
+    // Strict weak order: a before b if a should run first
+    struct Precedes {
+        bool operator()(const Active& a, const Active& b) const {
+            if (a.request.priority != b.request.priority) {
+                return a.request.priority > b.request.priority;
+            }
+            if (a.request.deadline != b.request.deadline) {
+                return a.request.deadline < b.request.deadline;
+            }
+            return a.arrival < b.arrival;
+        }
+    };
+
+    StepFunction step;
+    size_t maxBatch;
+    MpmcQueue<Request> incoming;        // submitted, not yet seen by the scheduler thread
+    std::set<Active, Precedes> pending; // best first; preempted requests come back here
+    uint64_t arrivals;
+    std::mutex mutex; // guards stats
+    Stats stats;
+    std::thread worker;
+
+    // Moves the cancelled requests of pending into dropped
+    void dropCancelled(std::vector<Active>& dropped) {
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->request.cancel.isCancelled()) {
+                dropped.push_back(std::move(pending.extract(it++).value()));
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Fills the batch from pending, preempting running requests of lower priority than the
+    // best waiting one; returns the number of preemptions
+    size_t admit(std::vector<Active>& active) {
+        size_t preemptions = 0;
+        while (!pending.empty()) {
+            if (active.size() < maxBatch) {
+                active.push_back(std::move(pending.extract(pending.begin()).value()));
+                continue;
+            }
+            auto worst = std::max_element(active.begin(), active.end(), Precedes());
+            if (pending.begin()->request.priority <= worst->request.priority) {
+                break;
+            }
+            pending.insert(std::move(*worst));
+            *worst = std::move(pending.extract(pending.begin()).value());
+            ++preemptions;
+        }
+        return preemptions;
+    }
+
+    void schedulerLoop() {
+        std::vector<Active> active;
+        std::vector<Active> dropped;
+        std::vector<Request> arrived;
+        while (true) {
+            // Sleeps only when there is nothing to run
+            arrived.clear();
+            if (active.empty() && pending.empty()) {
+                if (incoming.popBatch(arrived, incoming.capacity()) == 0) {
+                    return; // closed and drained
+                }
+            } else {
+                incoming.tryPopBatch(arrived, incoming.capacity());
+            }
+            for (Request& request : arrived) {
+                pending.insert(Active{std::move(request), 0, arrivals++});
+            }
+            dropCancelled(dropped);
+            size_t preemptions = admit(active);
+
+            // Cancelled requests leave before the step, as do requests with nothing to generate
+            auto cancelled = std::partition(active.begin(), active.end(), [](const Active& a) {
+                return !a.request.cancel.isCancelled();
+            });
+            std::move(cancelled, active.end(), std::back_inserter(dropped));
+            active.erase(cancelled, active.end());
+            for (Active& a : dropped) {
+                a.request.onToken(-1, Event::Cancelled);
+            }
+            auto empty = std::partition(active.begin(), active.end(), [](const Active& a) {
+                return !a.request.tokenIds.empty() && a.generated < a.request.maxNewTokens;
+            });
+            for (auto it = empty; it != active.end(); ++it) {
+                it->request.onToken(-1, Event::Finished);
+            }
+            size_t finished = active.end() - empty;
+            size_t numDropped = dropped.size();
+            active.erase(empty, active.end());
+            dropped.clear();
+            if (active.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.completed += finished;
+                stats.preemptions += preemptions;
+                stats.cancelled += numDropped;
+                continue;
+            }
+
+            std::vector<std::vector<int>> sequences;
+            std::vector<int> adapters;
+            for (const Active& a : active) {
+                sequences.push_back(a.request.tokenIds);
+                adapters.push_back(a.request.adapter);
+            }
+            std::vector<int> next;
+            try {
+                next = step(sequences, adapters);
+            } catch (...) {
+                for (Active& a : active) {
+                    a.request.onToken(-1, Event::Failed);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.completed += finished;
+                stats.preemptions += preemptions;
+                stats.cancelled += numDropped;
+                stats.failed += active.size();
+                active.clear();
+                continue;
+            }
+            for (size_t i = 0; i < active.size(); ++i) {
+                active[i].request.tokenIds.push_back(next[i]);
+                ++active[i].generated;
+                bool last = active[i].generated >= active[i].request.maxNewTokens;
+                active[i].request.onToken(next[i], last ? Event::Finished : Event::Token);
+            }
+            size_t before = active.size();
+            active.erase(std::remove_if(active.begin(), active.end(), [](const Active& a) {
+                return a.generated >= a.request.maxNewTokens;
+            }), active.end());
+
+            std::lock_guard<std::mutex> lock(mutex);
+            ++stats.steps;
+            stats.tokens += before;
+            stats.completed += finished + before - active.size();
+            stats.preemptions += preemptions;
+            stats.cancelled += numDropped;
+        }
+    }
+
+public:
+    // queueCapacity bounds the submitted requests the scheduler thread has not picked up yet;
+    // submit() waits while it is reached and trySubmit() fails
+    explicit BatchScheduler(StepFunction stepFunction, size_t maxBatchSize = 32, size_t queueCapacity = 1024)
+        : step(std::move(stepFunction)), maxBatch(std::max<size_t>(maxBatchSize, 1)), incoming(queueCapacity),
+          arrivals(0) {
+        worker = std::thread([this] { schedulerLoop(); });
+    }
+
+    // Finishes every submitted request before returning
+    ~BatchScheduler() {
+        incoming.close();
+        worker.join();
+    }
+
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+    // Safe to call from any number of threads
+    void submit(Request request) {
+        if (!incoming.push(std::move(request))) {
+            throw std::logic_error("BatchScheduler: submit after shutdown");
+        }
+    }
+
+    // submit() for threads that must not block (an event loop): false, with request left as
+    // it was, while the queue is full
+    bool trySubmit(Request&& request) {
+        return incoming.tryPush(std::move(request));
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+};
+
+#endif // BATCH_SCHEDULER_H
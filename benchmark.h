@@ -0,0 +1,407 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <functional>
+#include "transformer_layers.h"
+#include "perf_counters.h"
+#include "weight_stream.h"
+#include "hnsw_index.h"
+#include "mpmc_queue.h"
+#include "bulk_scorer.h"
+#include <cstdio>
+#include <ctime>
+
+// Micro-benchmarks reachable from the command line (see main.cpp)
+namespace Benchmark {
+
+    const uint64_t CACHE_LINE_BYTES = 64;
+
+    double elapsedMs(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::string formatBytes(double bytes) {
+        const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+        int unit = 0;
+        while (bytes >= 1024.0 && unit < 4) {
+            bytes /= 1024.0;
+            ++unit;
+        }
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << bytes << " " << units[unit];
+        return out.str();
+    }
+
+    // Batch prefill through the encoder in each execution mode. DRAM traffic is measured
+    // as last-level cache misses x 64 bytes when perf events are available. The modeled
+    // figure is the weight bytes each mode streams past the core: once per token when
+    // token-tiled, once per batch when weight-stationary; it approximates DRAM traffic
+    // when a layer's weights do not fit in L2.
+    void encoderPrefill(int seqLen, int embeddingDim, int numHeads, int ffnHiddenDim, int numLayers) {
+        Encoder encoder(numLayers, embeddingDim, numHeads, ffnHiddenDim);
+        Matrix input;
+        Utils::initializeMatrix(input, seqLen, embeddingDim);
+
+        double layerWeightBytes = sizeof(float) * (4.0 * embeddingDim * embeddingDim + 2.0 * embeddingDim * ffnHiddenDim);
+        std::cout << "Encoder prefill: " << seqLen << " tokens, dim " << embeddingDim << ", ffn " << ffnHiddenDim
+                  << ", " << numLayers << " layers, " << formatBytes(layerWeightBytes) << " of weights per layer\n";
+
+        encoder.forward(input); // warm up the pool and first-touch the weights
+        const ExecutionMode modes[] = {ExecutionMode::TokenTiled, ExecutionMode::WeightStationary};
+        const char* names[] = {"token-tiled", "weight-stationary"};
+        for (int m = 0; m < 2; ++m) {
+            encoder.setExecutionMode(modes[m]);
+            PerfCounter llcMisses = PerfCounter::lastLevelCacheMisses();
+            llcMisses.start();
+            auto start = std::chrono::steady_clock::now();
+            encoder.forward(input);
+            double ms = elapsedMs(start);
+            uint64_t misses = llcMisses.stop();
+
+            double modeledBytes = layerWeightBytes * numLayers * (modes[m] == ExecutionMode::TokenTiled ? seqLen : 1);
+            std::cout << "  " << std::left << std::setw(18) << names[m] << std::right
+                      << std::fixed << std::setprecision(2) << std::setw(10) << ms << " ms"
+                      << "  DRAM measured: "
+                      << (llcMisses.available() ? formatBytes(double(misses) * CACHE_LINE_BYTES) : std::string("n/a"))
+                      << "  weights modeled: " << formatBytes(modeledBytes) << "\n";
+        }
+    }
+
+    // Single-token decode steps (GEMV-bound) through an encoder whose weights come from
+    // normal pages, then from huge pages, with data-TLB misses counted for each.
+    void weightPaging(int embeddingDim, int numHeads, int ffnHiddenDim, int numLayers, int steps) {
+        HugePageArena& arena = HugePageArena::weights();
+        const HugePageArena::PagePolicy policies[] = {HugePageArena::NormalPages, HugePageArena::HugeTlbPages};
+        const char* names[] = {"4 KB pages", "huge pages"};
+        std::cout << "Weight paging: dim " << embeddingDim << ", ffn " << ffnHiddenDim << ", " << numLayers
+                  << " layers, " << steps << " single-token steps\n";
+        for (int p = 0; p < 2; ++p) {
+            HugePageArena::Stats before = arena.getStats();
+            arena.setPagePolicy(policies[p]);
+            Encoder encoder(numLayers, embeddingDim, numHeads, ffnHiddenDim);
+            HugePageArena::Stats after = arena.getStats();
+
+            Matrix token;
+            Utils::initializeMatrix(token, 1, embeddingDim);
+            encoder.forward(token); // warm up
+
+            PerfCounter tlbMisses = PerfCounter::dataTlbMisses();
+            tlbMisses.start();
+            auto start = std::chrono::steady_clock::now();
+            for (int step = 0; step < steps; ++step) {
+                encoder.forward(token);
+            }
+            double ms = elapsedMs(start);
+            uint64_t misses = tlbMisses.stop();
+
+            std::cout << "  " << std::left << std::setw(12) << names[p] << std::right
+                      << std::fixed << std::setprecision(3) << std::setw(10) << ms / steps << " ms/step"
+                      << "  dTLB misses/step: "
+                      << (tlbMisses.available() ? std::to_string(misses / steps) : std::string("n/a"))
+                      << "  backing: hugetlb " << formatBytes(after.hugeTlbBytes - before.hugeTlbBytes)
+                      << ", thp " << formatBytes(after.transparentBytes - before.transparentBytes)
+                      << ", normal " << formatBytes(after.normalBytes - before.normalBytes) << "\n";
+        }
+    }
+
+    // Writes an encoder to a weight file, then streams it back under growing resident-memory
+    // budgets (1 layer, 2 layers, all layers) and reports throughput for each
+    void weightStreaming(int seqLen, int embeddingDim, int numHeads, int ffnHiddenDim, int numLayers,
+                         const std::string& path) {
+        {
+            Encoder source(numLayers, embeddingDim, numHeads, ffnHiddenDim);
+            source.saveWeights(path);
+        }
+        Encoder encoder(numLayers, embeddingDim, numHeads, ffnHiddenDim, false);
+        encoder.setExecutionMode(ExecutionMode::WeightStationary);
+        Matrix input;
+        Utils::initializeMatrix(input, seqLen, embeddingDim);
+
+        double layerWeightBytes = sizeof(float) * (4.0 * embeddingDim * embeddingDim + 2.0 * embeddingDim * ffnHiddenDim);
+        std::cout << "Weight streaming: " << seqLen << " tokens, dim " << embeddingDim << ", ffn " << ffnHiddenDim
+                  << ", " << numLayers << " layers, " << formatBytes(layerWeightBytes) << " per layer\n";
+        for (int residentLayers : {1, 2, numLayers}) {
+            WeightStream stream(path, size_t(residentLayers * layerWeightBytes));
+            auto start = std::chrono::steady_clock::now();
+            encoder.forward(input, stream);
+            double ms = elapsedMs(start);
+            std::cout << "  budget " << std::setw(10) << formatBytes(residentLayers * layerWeightBytes)
+                      << std::fixed << std::setprecision(2) << std::setw(10) << ms << " ms"
+                      << std::setw(12) << std::setprecision(1) << seqLen * 1000.0 / ms << " tokens/s\n";
+        }
+        std::remove(path.c_str());
+    }
+
+    // Builds an HNSW index over numVectors random unit vectors with float and with int8
+    // storage and reports build time, batch search throughput and recall@k against an exact
+    // scan. The float index is also saved and searched again from the mapped file.
+    void vectorIndex(int numVectors, int dim, int k, const std::string& path) {
+        int numQueries = 200;
+        Matrix rows;
+        Utils::initializeMatrix(rows, numVectors + numQueries, dim);
+        Vector vectors, queries;
+        for (int i = 0; i < numVectors + numQueries; ++i) {
+            (i < numVectors ? vectors : queries).insert(i < numVectors ? vectors.end() : queries.end(),
+                                                        rows[i].begin(), rows[i].end());
+        }
+        Utils::normalizeRows(vectors, dim);
+        Utils::normalizeRows(queries, dim);
+
+        // Exact neighbours by inner product
+        std::vector<std::vector<uint32_t>> exact(numQueries);
+        ThreadPool::shared().parallelFor(0, numQueries, 8, [&](size_t begin, size_t end) {
+            for (size_t q = begin; q < end; ++q) {
+                std::vector<std::pair<float, uint32_t>> scored;
+                for (int i = 0; i < numVectors; ++i) {
+                    scored.emplace_back(-Utils::dotProduct(&queries[q * dim], &vectors[i * size_t(dim)], dim), i);
+                }
+                std::partial_sort(scored.begin(), scored.begin() + k, scored.end());
+                for (int j = 0; j < k; ++j) {
+                    exact[q].push_back(scored[j].second);
+                }
+            }
+        });
+        auto report = [&](const char* name, const HnswIndex& index, double buildMs) {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::vector<HnswIndex::Neighbor>> found = index.searchBatch(queries, k);
+            double ms = elapsedMs(start);
+            size_t hits = 0;
+            for (int q = 0; q < numQueries; ++q) {
+                for (const HnswIndex::Neighbor& neighbor : found[q]) {
+                    hits += std::count(exact[q].begin(), exact[q].end(), neighbor.id);
+                }
+            }
+            std::cout << "  " << std::left << std::setw(8) << name << std::right << std::fixed
+                      << "  build " << std::setprecision(1) << std::setw(9) << buildMs << " ms"
+                      << "  search " << std::setw(10) << numQueries * 1000.0 / ms << " queries/s"
+                      << "  recall@" << k << " " << std::setprecision(3) << double(hits) / (numQueries * k) << "\n";
+        };
+
+        std::cout << "Vector index: " << numVectors << " vectors, dim " << dim << ", " << numQueries << " queries\n";
+        for (bool int8 : {false, true}) {
+            HnswIndex::Params params;
+            params.int8 = int8;
+            HnswIndex index(dim, params);
+            auto start = std::chrono::steady_clock::now();
+            index.add(vectors);
+            double buildMs = elapsedMs(start);
+            report(int8 ? "int8" : "float", index, buildMs);
+            if (!int8) {
+                index.save(path);
+                HnswIndex mapped(path);
+                report("mapped", mapped, 0.0);
+            }
+        }
+        std::remove(path.c_str());
+    }
+
+    // Request handoff at full rate: producers push ids as fast as they can while consumers pop
+    // them, through the mutex+condvar BoundedQueue (one pop per item) and through MpmcQueue
+    // with single and batched pops, all with the same capacity. Reports items/s and the cost
+    // per item; the id checksum confirms nothing was lost or duplicated.
+    void requestQueue(int producers, int consumers, int itemsPerProducer) {
+        const size_t capacity = 1024;
+        const size_t batch = 64;
+        uint64_t total = uint64_t(producers) * itemsPerProducer;
+        uint64_t expectedSum = total * (total - 1) / 2;
+        std::cout << "Request queue: " << producers << " producers, " << consumers << " consumers, "
+                  << total << " items, capacity " << capacity << "\n";
+
+        auto report = [&](const char* name, double ms, uint64_t sum) {
+            std::cout << "  " << std::left << std::setw(22) << name << std::right << std::fixed
+                      << std::setprecision(2) << std::setw(10) << ms << " ms"
+                      << std::setw(14) << std::setprecision(0) << total * 1000.0 / ms << " items/s"
+                      << std::setw(10) << std::setprecision(1) << ms * 1e6 / total << " ns/item"
+                      << (sum == expectedSum ? "" : "  CHECKSUM MISMATCH") << "\n";
+        };
+
+        // Runs producers and consumers over a queue; pop(sum) returns false once it is drained
+        auto run = [&](const std::function<void(uint64_t)>& push, const std::function<bool(uint64_t&)>& pop,
+                       const std::function<void()>& close) {
+            std::atomic<uint64_t> sum{0};
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (int c = 0; c < consumers; ++c) {
+                threads.emplace_back([&] {
+                    uint64_t local = 0;
+                    while (pop(local)) {
+                    }
+                    sum += local;
+                });
+            }
+            std::vector<std::thread> pushers;
+            for (int p = 0; p < producers; ++p) {
+                pushers.emplace_back([&, p] {
+                    for (uint64_t i = uint64_t(p) * itemsPerProducer; i < uint64_t(p + 1) * itemsPerProducer; ++i) {
+                        push(i);
+                    }
+                });
+            }
+            for (std::thread& pusher : pushers) {
+                pusher.join();
+            }
+            close();
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            return std::make_pair(elapsedMs(start), sum.load());
+        };
+
+        {
+            BoundedQueue<uint64_t> queue(capacity);
+            auto result = run([&](uint64_t id) { queue.push(id); },
+                              [&](uint64_t& sum) {
+                                  uint64_t id;
+                                  if (!queue.pop(id)) {
+                                      return false;
+                                  }
+                                  sum += id;
+                                  return true;
+                              },
+                              [&] { queue.close(); });
+            report("mutex+condvar", result.first, result.second);
+        }
+        for (size_t maxItems : {size_t(1), batch}) {
+            MpmcQueue<uint64_t> queue(capacity);
+            auto result = run([&](uint64_t id) { queue.push(id); },
+                              [&](uint64_t& sum) {
+                                  thread_local std::vector<uint64_t> ids;
+                                  ids.clear();
+                                  if (queue.popBatch(ids, maxItems) == 0) {
+                                      return false;
+                                  }
+                                  for (uint64_t id : ids) {
+                                      sum += id;
+                                  }
+                                  return true;
+                              },
+                              [&] { queue.close(); });
+            report(maxItems == 1 ? "lock-free" : "lock-free, batch 64", result.first, result.second);
+        }
+    }
+
+    // Per-region dispatch overhead of parallelFor under several spin limits (idle and join
+    // alike; 0 parks right away): regions of one tiny tile per thread, run back to back and
+    // after gapMicros of serial work each (the caller's share between regions of a decode
+    // step). Wall time per region is the dispatch latency; CPU time per region includes the
+    // spinning it costs.
+    void poolDispatch(int numWorkers, int regions, int gapMicros) {
+        std::cout << "Pool dispatch: " << numWorkers << " workers, " << regions << " regions of "
+                  << numWorkers + 1 << " tiles, " << std::thread::hardware_concurrency() << " hardware threads\n";
+        auto busyWait = [](int micros) {
+            auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(micros);
+            while (std::chrono::steady_clock::now() < until) {
+            }
+        };
+        std::atomic<uint64_t> sink{0};
+        auto body = [&sink](size_t begin, size_t) {
+            uint64_t x = begin;
+            for (int i = 0; i < 64; ++i) {
+                x = x * 6364136223846793005ull + 1442695040888963407ull;
+            }
+            sink += x;
+        };
+        for (int spinMicros : {0, 5, 20, 50, 200}) {
+            ThreadPool::SpinLimits spin;
+            spin.idle = spin.join = std::chrono::microseconds(spinMicros);
+            ThreadPool pool(numWorkers, spin);
+            for (int r = 0; r < 100; ++r) {
+                pool.parallelFor(0, numWorkers + 1, 1, body);
+            }
+            std::clock_t cpuStart = std::clock();
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < regions; ++r) {
+                pool.parallelFor(0, numWorkers + 1, 1, body);
+            }
+            double backToBackUs = elapsedMs(start) * 1000.0 / regions;
+            double cpuUs = (std::clock() - cpuStart) * 1e6 / CLOCKS_PER_SEC / regions;
+            double afterGapUs = 0.0;
+            for (int r = 0; r < regions; ++r) {
+                busyWait(gapMicros);
+                auto regionStart = std::chrono::steady_clock::now();
+                pool.parallelFor(0, numWorkers + 1, 1, body);
+                afterGapUs += elapsedMs(regionStart) * 1000.0 / regions;
+            }
+            std::cout << "  spin " << std::setw(4) << spinMicros << " us" << std::fixed << std::setprecision(2)
+                      << "  back-to-back " << std::setw(7) << backToBackUs << " us/region (cpu " << std::setw(7)
+                      << cpuUs << ")  after " << gapMicros << " us gaps " << std::setw(7) << afterGapUs << " us/region\n";
+        }
+    }
+
+    // One packed pass over numSequences sequences served by numAdapters LoRA adapters
+    // (sequence s uses adapter s % numAdapters) against the base model alone and against one
+    // pass per adapter, the alternative when a batch may only hold one adapter. Each adapter
+    // costs rank x (in + out) floats per matrix instead of a copy of the layer's weights.
+    void multiLora(int numSequences, int seqLen, int embeddingDim, int numHeads, int ffnHiddenDim, int numLayers,
+                   int numAdapters, int rank) {
+        Encoder encoder(numLayers, embeddingDim, numHeads, ffnHiddenDim);
+        LoraConfig config;
+        config.rank = rank;
+        for (int id = 0; id < numAdapters; ++id) {
+            encoder.addAdapter(id, config);
+        }
+        Matrix input;
+        Utils::initializeMatrix(input, numSequences * seqLen, embeddingDim);
+        SequenceOffsets sequences(1, 0);
+        std::vector<int> adapterIds;
+        for (int s = 0; s < numSequences; ++s) {
+            sequences.push_back(sequences.back() + seqLen);
+            adapterIds.push_back(s % numAdapters);
+        }
+        RowAdapters rowAdapters = Utils::adapterRows(sequences, adapterIds);
+
+        double layerWeightBytes = sizeof(float) * (4.0 * embeddingDim * embeddingDim + 2.0 * embeddingDim * ffnHiddenDim);
+        double adapterBytes = sizeof(float) * rank * (8.0 * embeddingDim + 2.0 * (embeddingDim + ffnHiddenDim));
+        std::cout << "Multi-LoRA: " << numSequences << " sequences x " << seqLen << " tokens, dim " << embeddingDim
+                  << ", ffn " << ffnHiddenDim << ", " << numLayers << " layers, " << numAdapters << " adapters of rank "
+                  << rank << " (" << formatBytes(adapterBytes) << " per layer each, base "
+                  << formatBytes(layerWeightBytes) << ")\n";
+
+        // Best of three runs, the deltas being a few percent of a pass
+        auto bestMs = [](const std::function<void()>& run) {
+            double best = 0.0;
+            for (int r = 0; r < 3; ++r) {
+                auto start = std::chrono::steady_clock::now();
+                run();
+                double ms = elapsedMs(start);
+                best = r == 0 ? ms : std::min(best, ms);
+            }
+            return best;
+        };
+        encoder.forward(input, sequences, rowAdapters); // warm up
+        const ExecutionMode modes[] = {ExecutionMode::TokenTiled, ExecutionMode::WeightStationary};
+        const char* names[] = {"token-tiled", "weight-stationary"};
+        for (int m = 0; m < 2; ++m) {
+            encoder.setExecutionMode(modes[m]);
+            double baseMs = bestMs([&] { encoder.forward(input, sequences); });
+            double mixedMs = bestMs([&] { encoder.forward(input, sequences, rowAdapters); });
+            double perAdapterMs = bestMs([&] {
+                for (int id = 0; id < numAdapters; ++id) {
+                    Matrix group;
+                    SequenceOffsets groupSequences(1, 0);
+                    for (int s = id; s < numSequences; s += numAdapters) {
+                        group.insert(group.end(), input.begin() + sequences[s], input.begin() + sequences[s + 1]);
+                        groupSequences.push_back(group.size());
+                    }
+                    if (!group.empty()) {
+                        encoder.forward(group, groupSequences, RowAdapters(group.size(), id));
+                    }
+                }
+            });
+
+            std::cout << "  " << std::left << std::setw(18) << names[m] << std::right << std::fixed
+                      << std::setprecision(2) << "  base " << std::setw(9) << baseMs << " ms  mixed batch "
+                      << std::setw(9) << mixedMs << " ms (" << std::showpos << std::setprecision(1)
+                      << 100.0 * (mixedMs - baseMs) / baseMs << std::noshowpos << "%)  pass per adapter "
+                      << std::setprecision(2) << std::setw(9) << perAdapterMs << " ms\n";
+        }
+    }
+
+}
+
+#endif // BENCHMARK_H
@@ -0,0 +1,379 @@
+#ifndef BULK_SCORER_H
+#define BULK_SCORER_H
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <chrono>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Blocking FIFO of at most capacity items between pipeline stages. close() wakes every
+// waiter: pop then drains what is left and returns false once the queue is empty.
+template <typename T>
+class BoundedQueue {
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+
+public:
+    explicit BoundedQueue(size_t maxItems) : capacity(std::max<size_t>(maxItems, 1)), closed(false) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
+
+// Reads a file (or stdin for "-") a block of lines at a time. Regular files are mapped and
+// read sequentially from the page cache; pipes and other streams go through large buffered
+// reads. Line endings ("\n" or "\r\n") are stripped; a last line without one still counts.
+class LineReader {
+private:
+    static const size_t READ_BYTES = size_t(16) << 20;
+
+    std::FILE* file;
+    bool ownsFile;
+    const char* mapped;
+    size_t mappedBytes;
+    size_t position;
+    std::vector<char> buffer; // streamed input: [position, filled) not yet consumed
+    size_t filled;
+    bool endOfInput;
+
+    static void addLine(std::vector<std::string>& lines, const char* begin, const char* end) {
+        if (end > begin && end[-1] == '\r') {
+            --end;
+        }
+        lines.emplace_back(begin, end);
+    }
+
+    // Moves the unconsumed tail to the front of the buffer and reads after it
+    void refill() {
+        std::memmove(buffer.data(), buffer.data() + position, filled - position);
+        filled -= position;
+        position = 0;
+        if (filled == buffer.size()) {
+            buffer.resize(buffer.size() * 2); // a single line longer than the buffer
+        }
+        size_t n = std::fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+        filled += n;
+        endOfInput = n == 0;
+    }
+
+public:
+    explicit LineReader(const std::string& path)
+        : file(nullptr), ownsFile(false), mapped(nullptr), mappedBytes(0), position(0), filled(0), endOfInput(false) {
+        if (path == "-") {
+            file = stdin;
+        } else {
+#if defined(__linux__)
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address != MAP_FAILED) {
+                    madvise(address, info.st_size, MADV_SEQUENTIAL);
+                    mapped = static_cast<const char*>(address);
+                    mappedBytes = info.st_size;
+                }
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            if (mapped) {
+                return;
+            }
+#endif
+            file = std::fopen(path.c_str(), "rb");
+            ownsFile = true;
+            if (!file) {
+                throw std::runtime_error("Cannot open " + path);
+            }
+        }
+        buffer.resize(READ_BYTES);
+    }
+
+    ~LineReader() {
+#if defined(__linux__)
+        if (mapped) {
+            munmap(const_cast<char*>(mapped), mappedBytes);
+        }
+#endif
+        if (ownsFile && file) {
+            std::fclose(file);
+        }
+    }
+
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    // Replaces lines with up to maxLines next lines; false once the input is exhausted
+    bool readBlock(std::vector<std::string>& lines, size_t maxLines) {
+        lines.clear();
+        if (mapped) {
+            while (lines.size() < maxLines && position < mappedBytes) {
+                const char* begin = mapped + position;
+                const char* newline = static_cast<const char*>(std::memchr(begin, '\n', mappedBytes - position));
+                const char* end = newline ? newline : mapped + mappedBytes;
+                addLine(lines, begin, end);
+                position = end - mapped + (newline ? 1 : 0);
+            }
+            return !lines.empty();
+        }
+        while (lines.size() < maxLines) {
+            const char* begin = buffer.data() + position;
+            const char* newline = static_cast<const char*>(std::memchr(begin, '\n', filled - position));
+            if (newline) {
+                addLine(lines, begin, newline);
+                position = newline - buffer.data() + 1;
+                continue;
+            }
+            if (endOfInput) {
+                if (position < filled) {
+                    addLine(lines, begin, buffer.data() + filled);
+                    position = filled;
+                }
+                break;
+            }
+            refill();
+        }
+        return !lines.empty();
+    }
+};
+
+// Offline scoring of a large line-per-record input, as a pipeline:
+//   reader (calling thread) -> tokenizer threads -> scoring thread -> writer thread
+// Lines travel in blocks; several tokenizer threads work on different blocks at once, so blocks
+// reach the scoring thread out of order and the writer puts them back in input order through a
+// reorder buffer. Within a block, lines are sorted by token count and cut into batches of
+// similar length under a token budget, so each score() call is one packed encoder pass over
+// sequences that cost about the same. Every stage is bounded, so memory does not grow with
+// the input.
+class BulkScorer {
+public:
+    typedef std::function<std::vector<int>(const std::string& line)> TokenizeFunction;
+
+    // Scores one batch, appending one output record per sequence, in batch order, to records
+    typedef std::function<void(const std::vector<std::vector<int>>& batch, std::vector<std::string>& records)> ScoreFunction;
+
+    struct Options {
+        size_t blockLines = 4096;        // lines per pipeline block
+        size_t maxBatchTokens = 8192;    // token budget of one score() call
+        size_t maxBatchSequences = 256;
+        size_t maxSequenceTokens = 0;    // tokens the model reads per sequence (0: all), for the budget
+        int tokenizerThreads = 2;
+        size_t blocksInFlight = 8;       // per queue between stages
+    };
+
+    struct Stats {
+        uint64_t lines = 0;
+        uint64_t tokens = 0;
+        uint64_t batches = 0;
+        double seconds = 0.0;
+
+        double linesPerHour() const {
+            return seconds > 0.0 ? lines * 3600.0 / seconds : 0.0;
+        }
+    };
+
+private:
+    struct Block {
+        uint64_t id = 0;
+        std::vector<std::string> lines;
+        std::vector<std::vector<int>> tokens;
+        std::string output;
+    };
+
+    TokenizeFunction tokenize;
+    ScoreFunction score;
+    Options options;
+
+    size_t cost(const std::vector<int>& tokenIds) const {
+        size_t length = tokenIds.size();
+        return std::max<size_t>(options.maxSequenceTokens > 0 ? std::min(length, options.maxSequenceTokens) : length, 1);
+    }
+
+    // Scores a block in length-bucketed batches and concatenates its records in line order
+    void scoreBlock(Block& block, Stats& stats) {
+        std::vector<size_t> order(block.tokens.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&block](size_t a, size_t b) {
+            return block.tokens[a].size() < block.tokens[b].size();
+        });
+
+        std::vector<std::string> records(order.size());
+        std::vector<std::vector<int>> batch;
+        std::vector<std::string> batchRecords;
+        size_t first = 0;
+        while (first < order.size()) {
+            size_t last = first;
+            size_t tokens = 0;
+            batch.clear();
+            while (last < order.size() && batch.size() < options.maxBatchSequences &&
+                   (batch.empty() || tokens + cost(block.tokens[order[last]]) <= options.maxBatchTokens)) {
+                tokens += cost(block.tokens[order[last]]);
+                stats.tokens += block.tokens[order[last]].size();
+                batch.push_back(std::move(block.tokens[order[last]]));
+                ++last;
+            }
+            batchRecords.clear();
+            score(batch, batchRecords);
+            if (batchRecords.size() != batch.size()) {
+                throw std::logic_error("BulkScorer: score() must return one record per sequence");
+            }
+            for (size_t i = first; i < last; ++i) {
+                records[order[i]] = std::move(batchRecords[i - first]);
+            }
+            ++stats.batches;
+            first = last;
+        }
+
+        block.tokens.clear();
+        size_t bytes = 0;
+        for (const std::string& record : records) {
+            bytes += record.size();
+        }
+        block.output.reserve(bytes);
+        for (const std::string& record : records) {
+            block.output += record;
+        }
+    }
+
+public:
+    BulkScorer(TokenizeFunction tokenizeFunction, ScoreFunction scoreFunction, const Options& scorerOptions)
+        : tokenize(std::move(tokenizeFunction)), score(std::move(scoreFunction)), options(scorerOptions) {}
+
+    // Scores every line of input and writes the records to output in input order. A scoring
+    // error is rethrown once the records of the blocks before the failing one are written.
+    Stats run(LineReader& input, std::FILE* output) {
+        auto start = std::chrono::steady_clock::now();
+        Stats stats;
+        BoundedQueue<Block> raw(options.blocksInFlight);
+        BoundedQueue<Block> tokenized(options.blocksInFlight);
+        BoundedQueue<Block> scored(options.blocksInFlight);
+
+        std::vector<std::thread> tokenizers;
+        for (int t = 0; t < std::max(options.tokenizerThreads, 1); ++t) {
+            tokenizers.emplace_back([this, &raw, &tokenized] {
+                Block block;
+                while (raw.pop(block)) {
+                    block.tokens.resize(block.lines.size());
+                    for (size_t i = 0; i < block.lines.size(); ++i) {
+                        block.tokens[i] = tokenize(block.lines[i]);
+                    }
+                    block.lines = std::vector<std::string>();
+                    tokenized.push(std::move(block));
+                }
+            });
+        }
+
+        // A block whose scoring fails is never written, and neither is any block after it
+        // (they are still drained so the tokenizers finish): the output stops at the last
+        // record before the failure instead of going on with empty ones
+        std::exception_ptr scoreError;
+        std::thread scorer([this, &tokenized, &scored, &stats, &scoreError] {
+            uint64_t failedId = std::numeric_limits<uint64_t>::max();
+            Block block;
+            while (tokenized.pop(block)) {
+                if (block.id > failedId) {
+                    continue;
+                }
+                try {
+                    scoreBlock(block, stats);
+                    scored.push(std::move(block));
+                } catch (...) {
+                    scoreError = std::current_exception(); // the earliest block's error wins
+                    failedId = block.id;
+                }
+            }
+            scored.close();
+        });
+
+        // Writes blocks in id order, holding back those that arrive early
+        bool writeFailed = false;
+        std::thread writer([&scored, output, &writeFailed] {
+            std::map<uint64_t, std::string> early;
+            uint64_t next = 0;
+            Block block;
+            while (scored.pop(block)) {
+                early[block.id] = std::move(block.output);
+                for (auto it = early.begin(); it != early.end() && it->first == next; it = early.erase(it), ++next) {
+                    if (std::fwrite(it->second.data(), 1, it->second.size(), output) != it->second.size()) {
+                        writeFailed = true;
+                    }
+                }
+            }
+            std::fflush(output);
+        });
+
+        Block block;
+        uint64_t nextId = 0;
+        while (input.readBlock(block.lines, options.blockLines)) {
+            stats.lines += block.lines.size();
+            block.id = nextId++;
+            raw.push(std::move(block));
+            block = Block();
+        }
+        raw.close();
+        for (std::thread& tokenizer : tokenizers) {
+            tokenizer.join();
+        }
+        tokenized.close();
+        scorer.join();
+        writer.join();
+
+        if (scoreError) {
+            std::rethrow_exception(scoreError);
+        }
+        if (writeFailed) {
+            throw std::runtime_error("BulkScorer: write failed");
+        }
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+};
+
+#endif // BULK_SCORER_H
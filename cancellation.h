@@ -0,0 +1,137 @@
+#ifndef CANCELLATION_H
+#define CANCELLATION_H
+
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+
+// Thrown by work abandoned through its CancellationToken
+class OperationCancelled : public std::runtime_error {
+public:
+    OperationCancelled() : std::runtime_error("operation cancelled") {}
+};
+
+// Cooperative cancellation: copies share one flag, so whoever holds a copy (a connection, a
+// watchdog...) can cancel the work holding another. A token with a deadline also counts as
+// cancelled once it passes, which is how a per-request time budget is expressed. A default
+// token never cancels and costs nothing to check.
+//
+// Long-running work checks the token of the innermost CancellationScope of the calling
+// thread at its natural boundaries (every task graph node, every encoder layer and stream
+// chunk, every generation step), so model code does not thread a token through every call.
+// Cancelled work throws OperationCancelled; the unwinding frees its KV blocks and buffers
+// right away.
+class CancellationToken {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    struct State {
+        std::atomic<bool> cancelled{false};
+        std::atomic<int64_t> deadline{INT64_MAX}; // Clock ticks since the epoch
+        std::shared_ptr<const State> parent;      // cancelled with it
+    };
+
+    static bool cancelled(const State* state) {
+        for (; state; state = state->parent.get()) {
+            if (state->cancelled.load(std::memory_order_relaxed)) {
+                return true;
+            }
+            int64_t deadline = state->deadline.load(std::memory_order_relaxed);
+            if (deadline != INT64_MAX && Clock::now().time_since_epoch().count() >= deadline) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::shared_ptr<State> state;
+
+    static CancellationToken& currentSlot() {
+        thread_local CancellationToken current;
+        return current;
+    }
+
+    friend class CancellationScope;
+
+public:
+    CancellationToken() {}
+
+    // A token that can be cancelled
+    static CancellationToken create() {
+        CancellationToken token;
+        token.state = std::make_shared<State>();
+        return token;
+    }
+
+    // A token that cancels itself after budget (a per-request time budget)
+    static CancellationToken withBudget(std::chrono::milliseconds budget) {
+        CancellationToken token = create();
+        token.setDeadline(Clock::now() + budget);
+        return token;
+    }
+
+    // A token cancelled along with this one, or on its own (e.g. a request's budget under its
+    // connection's token)
+    CancellationToken child() const {
+        CancellationToken token = create();
+        token.state->parent = state;
+        return token;
+    }
+
+    // Only tokens from create()/withBudget()/child() can be cancelled; these do nothing on others
+    void cancel() {
+        if (state) {
+            state->cancelled.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void setDeadline(Clock::time_point deadline) {
+        if (state) {
+            state->deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+        }
+    }
+
+    bool isCancelled() const {
+        return cancelled(state.get());
+    }
+
+    void throwIfCancelled() const {
+        if (isCancelled()) {
+            throw OperationCancelled();
+        }
+    }
+
+    // The token of the calling thread's innermost CancellationScope (a default token outside any)
+    static const CancellationToken& current() {
+        return currentSlot();
+    }
+
+    static void throwIfCurrentCancelled() {
+        currentSlot().throwIfCancelled();
+    }
+};
+
+// Makes token the calling thread's current token for the scope's lifetime, e.g.
+//   CancellationScope scope(CancellationToken::withBudget(std::chrono::milliseconds(50)));
+//   transformer.predictNextWord(sentence); // throws OperationCancelled past 50 ms
+class CancellationScope {
+private:
+    CancellationToken previous;
+
+public:
+    explicit CancellationScope(const CancellationToken& token) : previous(CancellationToken::currentSlot()) {
+        CancellationToken::currentSlot() = token;
+    }
+
+    ~CancellationScope() {
+        CancellationToken::currentSlot() = previous;
+    }
+
+    CancellationScope(const CancellationScope&) = delete;
+    CancellationScope& operator=(const CancellationScope&) = delete;
+};
+
+#endif // CANCELLATION_H
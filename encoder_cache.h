@@ -0,0 +1,370 @@
+#ifndef ENCODER_CACHE_H
+#define ENCODER_CACHE_H
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <cstdint>
+#include "transformer_types.h"
+#include "cancellation.h"
+
+namespace Utils {
+
+    // Hash of a token-id sequence, chaining splitmix64 over the ids and the length
+    uint64_t hashTokens(const std::vector<int>& tokenIds) {
+        uint64_t hash = splitmix64(tokenIds.size());
+        for (int tokenId : tokenIds) {
+            hash = splitmix64(hash ^ static_cast<uint32_t>(tokenId));
+        }
+        return hash;
+    }
+
+    // Heap bytes held by a Matrix, row headers included
+    size_t matrixBytes(const Matrix& matrix) {
+        size_t bytes = sizeof(Matrix) + matrix.capacity() * sizeof(Vector);
+        for (const Vector& row : matrix) {
+            bytes += row.capacity() * sizeof(float);
+        }
+        return bytes;
+    }
+
+}
+
+// Bounded LRU map from token-id sequence to an immutable result (an encoder output, logits...).
+// Keys are spread over independently locked shards by hash, so concurrent requests rarely
+// contend; each shard evicts its least recently used entries to stay within its share of the
+// byte budget. Values are handed out as shared_ptr, so a hit costs no copy and an entry can
+// be evicted while a reader still holds it. The full token sequence is kept and compared, so
+// hash collisions never return another sequence's result.
+template <typename Value>
+class ShardedLruCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t budgetBytes = 0;
+
+        double hitRate() const {
+            return hits + misses > 0 ? double(hits) / (hits + misses) : 0.0;
+        }
+    };
+
+private:
+    // Map node, list node and bookkeeping charged to every entry on top of key and value
+    static const size_t ENTRY_OVERHEAD_BYTES = 128;
+
+    struct Entry {
+        uint64_t hash;
+        std::vector<int> tokenIds;
+        std::shared_ptr<const Value> value;
+        size_t bytes;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> entries; // most recently used first
+        std::unordered_map<uint64_t, typename std::list<Entry>::iterator> index;
+        size_t bytes = 0;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t shardBudget;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> insertions;
+    std::atomic<uint64_t> evictions;
+
+    Shard& shardFor(uint64_t hash) {
+        return *shards[(hash >> 32) % shards.size()];
+    }
+
+    void erase(Shard& shard, typename std::list<Entry>::iterator entry) {
+        shard.bytes -= entry->bytes;
+        shard.index.erase(entry->hash);
+        shard.entries.erase(entry);
+    }
+
+public:
+    // A budget of 0 disables the cache (every get misses, put does nothing)
+    explicit ShardedLruCache(size_t budgetBytes, size_t numShards = 16)
+        : shardBudget(budgetBytes / std::max<size_t>(numShards, 1)), hits(0), misses(0), insertions(0), evictions(0) {
+        for (size_t s = 0; s < std::max<size_t>(numShards, 1); ++s) {
+            shards.emplace_back(new Shard());
+        }
+    }
+
+    ShardedLruCache(const ShardedLruCache&) = delete;
+    ShardedLruCache& operator=(const ShardedLruCache&) = delete;
+
+    bool enabled() const {
+        return shardBudget > 0;
+    }
+
+    // The cached value for tokenIds, or null; a hit becomes the most recently used entry
+    std::shared_ptr<const Value> get(const std::vector<int>& tokenIds) {
+        if (!enabled()) {
+            return nullptr;
+        }
+        uint64_t hash = Utils::hashTokens(tokenIds);
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(hash);
+        if (found == shard.index.end() || found->second->tokenIds != tokenIds) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return found->second->value;
+    }
+
+    // Stores value for tokenIds, replacing any entry with the same hash. valueBytes is the
+    // value's memory footprint; entries larger than a shard's budget are not admitted.
+    void put(const std::vector<int>& tokenIds, std::shared_ptr<const Value> value, size_t valueBytes) {
+        size_t bytes = valueBytes + tokenIds.size() * sizeof(int) + ENTRY_OVERHEAD_BYTES;
+        if (!enabled() || bytes > shardBudget) {
+            return;
+        }
+        uint64_t hash = Utils::hashTokens(tokenIds);
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(hash);
+        if (found != shard.index.end()) {
+            erase(shard, found->second);
+        }
+        while (shard.bytes + bytes > shardBudget) {
+            erase(shard, std::prev(shard.entries.end()));
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        shard.entries.push_front(Entry{hash, tokenIds, std::move(value), bytes});
+        shard.index[hash] = shard.entries.begin();
+        shard.bytes += bytes;
+        insertions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void clear() {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->entries.clear();
+            shard->index.clear();
+            shard->bytes = 0;
+        }
+    }
+
+    Stats getStats() {
+        Stats stats;
+        stats.hits = hits.load();
+        stats.misses = misses.load();
+        stats.insertions = insertions.load();
+        stats.evictions = evictions.load();
+        stats.budgetBytes = shardBudget * shards.size();
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            stats.entries += shard->entries.size();
+            stats.bytes += shard->bytes;
+        }
+        return stats;
+    }
+};
+
+// Coalesces concurrent computations of the same token-id sequence: the first caller for a
+// sequence runs compute() and every caller arriving while it runs waits for that run and
+// shares its result (or its exception) instead of computing it again. Nothing is kept once
+// the run finishes, so this complements a cache rather than replacing it: duplicates arriving
+// within one computation are merged without waiting for the result to be cached. Sequences
+// are compared in full, so hash collisions never share a result. A run abandoned because its
+// own caller was cancelled (OperationCancelled) is not shared: its waiters try again.
+template <typename Value>
+class SingleFlight {
+public:
+    typedef std::shared_ptr<const Value> ValuePtr;
+
+    struct Stats {
+        uint64_t flights = 0;   // computations run
+        uint64_t coalesced = 0; // calls that shared another call's computation
+    };
+
+private:
+    struct Flight {
+        std::vector<int> tokenIds;
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool done = false;
+        ValuePtr value;
+        std::exception_ptr error;
+    };
+
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, std::shared_ptr<Flight>> inFlight;
+    std::atomic<uint64_t> flights;
+    std::atomic<uint64_t> coalesced;
+
+    static ValuePtr wait(Flight& flight) {
+        std::unique_lock<std::mutex> lock(flight.mutex);
+        flight.finished.wait(lock, [&flight] { return flight.done; });
+        if (flight.error) {
+            std::rethrow_exception(flight.error);
+        }
+        return flight.value;
+    }
+
+    void finish(uint64_t hash, const std::shared_ptr<Flight>& flight, ValuePtr value, std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto range = inFlight.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == flight) {
+                    inFlight.erase(it);
+                    break;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(flight->mutex);
+            flight->value = std::move(value);
+            flight->error = error;
+            flight->done = true;
+        }
+        flight->finished.notify_all();
+    }
+
+public:
+    SingleFlight() : flights(0), coalesced(0) {}
+
+    SingleFlight(const SingleFlight&) = delete;
+    SingleFlight& operator=(const SingleFlight&) = delete;
+
+    // compute()'s result for tokenIds, from the run already in flight for the same sequence
+    // if there is one
+    ValuePtr run(const std::vector<int>& tokenIds, const std::function<ValuePtr()>& compute) {
+        uint64_t hash = Utils::hashTokens(tokenIds);
+        std::shared_ptr<Flight> flight;
+        while (true) {
+            bool leader = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto range = inFlight.equal_range(hash);
+                for (auto it = range.first; it != range.second && !flight; ++it) {
+                    if (it->second->tokenIds == tokenIds) {
+                        flight = it->second;
+                    }
+                }
+                if (!flight) {
+                    flight = std::make_shared<Flight>();
+                    flight->tokenIds = tokenIds;
+                    inFlight.emplace(hash, flight);
+                    leader = true;
+                }
+            }
+            if (leader) {
+                break;
+            }
+            coalesced.fetch_add(1, std::memory_order_relaxed);
+            try {
+                return wait(*flight);
+            } catch (const OperationCancelled&) {
+                CancellationToken::throwIfCurrentCancelled(); // only give up if this caller was cancelled too
+                flight.reset();
+            }
+        }
+        flights.fetch_add(1, std::memory_order_relaxed);
+
+        ValuePtr value;
+        try {
+            value = compute();
+        } catch (...) {
+            finish(hash, flight, nullptr, std::current_exception());
+            throw;
+        }
+        finish(hash, flight, value, nullptr);
+        return value;
+    }
+
+    // run() for several sequences at once: the ones no other call is computing are computed
+    // together by a single compute(indices) call, which returns their values in the order of
+    // indices, and the rest are shared from the runs already in flight (a sequence repeated
+    // within keys included). Flights led by this call finish before it waits for any other,
+    // so two batches waiting on each other's sequences cannot deadlock.
+    std::vector<ValuePtr> runBatch(const std::vector<std::vector<int>>& keys,
+                                   const std::function<std::vector<ValuePtr>(const std::vector<size_t>&)>& compute) {
+        std::vector<ValuePtr> values(keys.size());
+        std::vector<size_t> pending(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            pending[i] = i;
+        }
+        while (!pending.empty()) {
+            std::vector<size_t> leading;
+            std::vector<std::pair<uint64_t, std::shared_ptr<Flight>>> led;
+            std::vector<std::pair<size_t, std::shared_ptr<Flight>>> joined;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i : pending) {
+                    uint64_t hash = Utils::hashTokens(keys[i]);
+                    std::shared_ptr<Flight> flight;
+                    auto range = inFlight.equal_range(hash);
+                    for (auto it = range.first; it != range.second && !flight; ++it) {
+                        if (it->second->tokenIds == keys[i]) {
+                            flight = it->second;
+                        }
+                    }
+                    if (flight) {
+                        joined.emplace_back(i, flight);
+                        continue;
+                    }
+                    flight = std::make_shared<Flight>();
+                    flight->tokenIds = keys[i];
+                    inFlight.emplace(hash, flight);
+                    leading.push_back(i);
+                    led.emplace_back(hash, flight);
+                }
+            }
+            flights.fetch_add(leading.size(), std::memory_order_relaxed);
+            coalesced.fetch_add(joined.size(), std::memory_order_relaxed);
+
+            if (!leading.empty()) {
+                std::vector<ValuePtr> computed;
+                try {
+                    computed = compute(leading);
+                } catch (...) {
+                    for (auto& flight : led) {
+                        finish(flight.first, flight.second, nullptr, std::current_exception());
+                    }
+                    throw;
+                }
+                for (size_t k = 0; k < leading.size(); ++k) {
+                    values[leading[k]] = computed[k];
+                    finish(led[k].first, led[k].second, computed[k], nullptr);
+                }
+            }
+            pending.clear();
+            for (auto& flight : joined) {
+                try {
+                    values[flight.first] = wait(*flight.second);
+                } catch (const OperationCancelled&) {
+                    CancellationToken::throwIfCurrentCancelled(); // as in run(): retry unless cancelled too
+                    pending.push_back(flight.first);
+                }
+            }
+        }
+        return values;
+    }
+
+    Stats getStats() const {
+        Stats stats;
+        stats.flights = flights.load();
+        stats.coalesced = coalesced.load();
+        return stats;
+    }
+};
+
+#endif // ENCODER_CACHE_H
@@ -0,0 +1,88 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Sleeping on a 32-bit atomic word without a mutex. wait() blocks while the word still holds
+// expected; wake() wakes threads blocked on it. Waits may return spuriously, so callers
+// re-check their condition in a loop. Elsewhere than Linux, wait() only yields.
+namespace Futex {
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32-bit word");
+
+    void wait(std::atomic<uint32_t>& word, uint32_t expected) {
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+        if (word.load() == expected) {
+            std::this_thread::yield();
+        }
+#endif
+    }
+
+    void wake(std::atomic<uint32_t>& word, int count) {
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+        (void)word;
+        (void)count;
+#endif
+    }
+
+}
+
+// Lets threads sleep until a condition of some lock-free structure holds. A waiter registers,
+// re-checks the condition and only then sleeps until the epoch moves. A notifier makes the
+// condition true first, then wakes every registered waiter and takes them off the count in one
+// step, so further notifications skip the kernel until someone registers again; while nobody
+// waits a notification costs a fence and a load.
+class EventCount {
+private:
+    // Epoch in the high half, registered waiters in the low half; futexes wait on the epoch
+    std::atomic<uint64_t> state{0};
+
+    static const uint64_t WAITER_MASK = 0xffffffffu;
+
+    std::atomic<uint32_t>& epoch() {
+        return reinterpret_cast<std::atomic<uint32_t>*>(&state)[__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? 1 : 0];
+    }
+
+public:
+    template <typename Condition>
+    void waitUntil(Condition ready) {
+        while (!ready()) {
+            uint64_t key = state.fetch_add(1, std::memory_order_seq_cst) >> 32;
+            std::atomic_thread_fence(std::memory_order_seq_cst); // the registration before the re-check
+            if (!ready()) {
+                Futex::wait(epoch(), uint32_t(key));
+            }
+            // Unregister, unless a notification already did
+            uint64_t current = state.load(std::memory_order_relaxed);
+            while ((current >> 32) == key &&
+                   !state.compare_exchange_weak(current, current - 1, std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    void notifyAll() {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // the condition's update before the waiters load
+        uint64_t current = state.load(std::memory_order_relaxed);
+        while ((current & WAITER_MASK) != 0) {
+            if (state.compare_exchange_weak(current, (current | WAITER_MASK) + 1, std::memory_order_seq_cst)) {
+                Futex::wake(epoch(), INT_MAX);
+                return;
+            }
+        }
+    }
+};
+
+#endif // FUTEX_H
@@ -0,0 +1,675 @@
+#ifndef HNSW_INDEX_H
+#define HNSW_INDEX_H
+
+#include <vector>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include "transformer_types.h"
+#include "pooling.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Approximate nearest-neighbour index over fixed-size vectors (e.g. pooled encoder embeddings)
+// using a hierarchical navigable small-world graph. Vectors are stored as floats or, with
+// Params::int8, as per-vector scaled int8 (queries are quantized the same way).
+//
+// add() inserts a batch of rows in parallel on the shared ThreadPool, with one lock per node's
+// link lists. Searches are lock-free and may run concurrently with each other, but not with
+// add(). save() writes the index to a file; the path constructor maps it back read-only and
+// searches straight from the mapping (a later add() first copies it into memory).
+class HnswIndex {
+public:
+    enum class Metric {
+        L2,          // squared Euclidean distance
+        InnerProduct // 1 - dot product; cosine distance for L2-normalized vectors
+    };
+
+    struct Params {
+        int M = 16;               // links per node on the upper levels (2 * M on level 0)
+        int efConstruction = 128; // candidate list size while inserting
+        int efSearch = 64;        // default candidate list size while searching
+        bool int8 = false;
+        Metric metric = Metric::InnerProduct;
+    };
+
+    struct Neighbor {
+        uint32_t id;
+        float distance;
+    };
+
+private:
+    static const uint32_t FILE_VERSION = 1;
+    static const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+    static const int MAX_LEVEL = 16;
+    static const size_t SECTION_ALIGNMENT = 64;
+
+    int dim;
+    Params params;
+    size_t count;
+    uint32_t entryPoint;
+    int maxLevel;
+
+    // Storage, owned or (after loading) inside the file mapping; the pointers below see either
+    std::vector<float> ownedFloats;   // count x dim
+    std::vector<int8_t> ownedInt8;    // count x dim
+    Vector ownedScales;               // per vector, int8 only
+    Vector ownedNorms;                // squared norm of the dequantized vector, int8 only
+    std::vector<uint32_t> ownedLevel0; // count x level0Stride(): link count, then ids
+    const float* floatData;
+    const int8_t* int8Data;
+    const float* scaleData;
+    const float* normData;
+    const uint32_t* level0Data;
+    void* mapping;
+    size_t mappingBytes;
+
+    std::vector<int> levels;
+    std::vector<std::vector<uint32_t>> upperLinks; // [node] levels[node] x upperStride()
+    mutable std::deque<std::mutex> linkLocks;      // guard a node's link lists during add()
+    std::mutex entryMutex;
+
+    // A vector ready to be compared against stored ones, in the storage format
+    struct Query {
+        const float* values = nullptr;
+        const int8_t* quantized = nullptr;
+        float scale = 1.0f;
+        float squaredNorm = 0.0f;
+        std::vector<int8_t> ownedQuantized;
+    };
+
+    // Per-thread visited marks; bumping the epoch clears them all at once
+    struct VisitedSet {
+        std::vector<uint32_t> marks;
+        uint32_t epoch = 0;
+
+        void reset(size_t size) {
+            if (marks.size() < size) {
+                marks.resize(size, 0);
+            }
+            if (++epoch == 0) {
+                std::fill(marks.begin(), marks.end(), 0);
+                epoch = 1;
+            }
+        }
+
+        // Marks id, returning whether it was already marked
+        bool visit(uint32_t id) {
+            bool seen = marks[id] == epoch;
+            marks[id] = epoch;
+            return seen;
+        }
+    };
+
+    static VisitedSet& visitedScratch() {
+        thread_local VisitedSet visited;
+        return visited;
+    }
+
+    size_t level0Stride() const {
+        return 1 + 2 * params.M;
+    }
+
+    size_t upperStride() const {
+        return 1 + params.M;
+    }
+
+    size_t maxLinks(int level) const {
+        return level == 0 ? 2 * params.M : params.M;
+    }
+
+    // Geometric level distribution with multiplier 1 / ln(M), drawn from the node id so that
+    // the graph's shape does not depend on the thread count
+    int randomLevel(uint32_t id) const {
+        double u = ((Utils::splitmix64(0x686e7377ULL ^ id) >> 11) + 1) * (1.0 / 9007199254740992.0);
+        int level = static_cast<int>(-std::log(u) / std::log(double(params.M)));
+        return std::min(level, MAX_LEVEL);
+    }
+
+    Query prepare(const float* values) const {
+        Query query;
+        if (!params.int8) {
+            query.values = values;
+            return query;
+        }
+        QuantizedEmbeddings quantized = Utils::quantizeRows(Vector(values, values + dim), dim);
+        query.ownedQuantized = std::move(quantized.values);
+        query.quantized = query.ownedQuantized.data();
+        query.scale = quantized.scales[0];
+        query.squaredNorm = Utils::dotProduct(values, values, dim);
+        return query;
+    }
+
+    Query nodeQuery(uint32_t id) const {
+        Query query;
+        if (params.int8) {
+            query.quantized = int8Data + size_t(id) * dim;
+            query.scale = scaleData[id];
+            query.squaredNorm = normData[id];
+        } else {
+            query.values = floatData + size_t(id) * dim;
+        }
+        return query;
+    }
+
+    float distance(const Query& query, uint32_t id) const {
+        if (params.int8) {
+            float dot = query.scale * scaleData[id] * Simd::dotInt8(query.quantized, int8Data + size_t(id) * dim, dim);
+            return params.metric == Metric::L2 ? query.squaredNorm + normData[id] - 2.0f * dot : 1.0f - dot;
+        }
+        const float* values = floatData + size_t(id) * dim;
+        return params.metric == Metric::L2 ? Utils::squaredDistance(query.values, values, dim)
+                                           : 1.0f - Utils::dotProduct(query.values, values, dim);
+    }
+
+    void prefetchVector(uint32_t id) const {
+        if (params.int8) {
+            __builtin_prefetch(int8Data + size_t(id) * dim);
+        } else {
+            __builtin_prefetch(floatData + size_t(id) * dim);
+        }
+    }
+
+    const uint32_t* links(uint32_t id, int level) const {
+        return level == 0 ? level0Data + id * level0Stride() : upperLinks[id].data() + (level - 1) * upperStride();
+    }
+
+    uint32_t* mutableLinks(uint32_t id, int level) {
+        return level == 0 ? ownedLevel0.data() + id * level0Stride() : upperLinks[id].data() + (level - 1) * upperStride();
+    }
+
+    // Copies id's links on level into out, under the node's lock while building
+    void copyLinks(uint32_t id, int level, std::vector<uint32_t>& out, bool building) const {
+        std::unique_lock<std::mutex> lock;
+        if (building) {
+            lock = std::unique_lock<std::mutex>(linkLocks[id]);
+        }
+        const uint32_t* list = links(id, level);
+        out.assign(list + 1, list + 1 + list[0]);
+    }
+
+    // Greedy walk from entry down to level toLevel + 1, moving to the closest neighbour each time
+    Neighbor descend(const Query& query, Neighbor entry, int fromLevel, int toLevel, bool building) const {
+        std::vector<uint32_t> neighbors;
+        for (int level = fromLevel; level > toLevel; --level) {
+            bool moved = true;
+            while (moved) {
+                moved = false;
+                copyLinks(entry.id, level, neighbors, building);
+                for (uint32_t neighbor : neighbors) {
+                    float d = distance(query, neighbor);
+                    if (d < entry.distance) {
+                        entry = Neighbor{neighbor, d};
+                        moved = true;
+                    }
+                }
+            }
+        }
+        return entry;
+    }
+
+    // Best-first search of one level keeping the ef closest nodes found; returns them closest first
+    std::vector<Neighbor> searchLayer(const Query& query, const std::vector<Neighbor>& entries, size_t ef, int level,
+                                      bool building) const {
+        auto closer = [](const Neighbor& a, const Neighbor& b) { return a.distance < b.distance; };
+        auto further = [](const Neighbor& a, const Neighbor& b) { return a.distance > b.distance; };
+        std::priority_queue<Neighbor, std::vector<Neighbor>, decltype(further)> candidates(further);
+        std::priority_queue<Neighbor, std::vector<Neighbor>, decltype(closer)> results(closer);
+
+        VisitedSet& visited = visitedScratch();
+        visited.reset(count);
+        for (const Neighbor& entry : entries) {
+            if (!visited.visit(entry.id)) {
+                candidates.push(entry);
+                results.push(entry);
+            }
+        }
+        while (results.size() > ef) {
+            results.pop();
+        }
+
+        std::vector<uint32_t> neighbors;
+        while (!candidates.empty()) {
+            Neighbor current = candidates.top();
+            if (results.size() >= ef && current.distance > results.top().distance) {
+                break;
+            }
+            candidates.pop();
+            copyLinks(current.id, level, neighbors, building);
+            for (size_t i = 0; i < neighbors.size(); ++i) {
+                if (i + 1 < neighbors.size()) {
+                    prefetchVector(neighbors[i + 1]);
+                }
+                if (visited.visit(neighbors[i])) {
+                    continue;
+                }
+                float d = distance(query, neighbors[i]);
+                if (results.size() < ef || d < results.top().distance) {
+                    candidates.push(Neighbor{neighbors[i], d});
+                    results.push(Neighbor{neighbors[i], d});
+                    if (results.size() > ef) {
+                        results.pop();
+                    }
+                }
+            }
+        }
+
+        std::vector<Neighbor> found(results.size());
+        for (size_t i = found.size(); i-- > 0;) {
+            found[i] = results.top();
+            results.pop();
+        }
+        return found;
+    }
+
+    // Neighbour selection heuristic: walking the candidates closest first, a candidate is kept
+    // only if it is closer to the base node than to every candidate kept so far, which spreads
+    // the links over different directions
+    std::vector<Neighbor> selectNeighbors(const std::vector<Neighbor>& candidates, size_t maxCount) const {
+        std::vector<Neighbor> selected;
+        for (const Neighbor& candidate : candidates) {
+            if (selected.size() >= maxCount) {
+                break;
+            }
+            Query candidateQuery = nodeQuery(candidate.id);
+            bool diverse = true;
+            for (const Neighbor& kept : selected) {
+                if (distance(candidateQuery, kept.id) < candidate.distance) {
+                    diverse = false;
+                    break;
+                }
+            }
+            if (diverse) {
+                selected.push_back(candidate);
+            }
+        }
+        return selected;
+    }
+
+    void setLinks(uint32_t id, int level, const std::vector<Neighbor>& neighbors) {
+        std::lock_guard<std::mutex> lock(linkLocks[id]);
+        uint32_t* list = mutableLinks(id, level);
+        list[0] = neighbors.size();
+        for (size_t i = 0; i < neighbors.size(); ++i) {
+            list[1 + i] = neighbors[i].id;
+        }
+    }
+
+    // Adds a link target -> id, re-selecting target's links when its list is full
+    void connect(uint32_t target, uint32_t id, int level) {
+        std::lock_guard<std::mutex> lock(linkLocks[target]);
+        uint32_t* list = mutableLinks(target, level);
+        uint32_t size = list[0];
+        if (size < maxLinks(level)) {
+            list[1 + size] = id;
+            list[0] = size + 1;
+            return;
+        }
+        Query targetQuery = nodeQuery(target);
+        std::vector<Neighbor> candidates;
+        for (uint32_t i = 0; i < size; ++i) {
+            candidates.push_back(Neighbor{list[1 + i], distance(targetQuery, list[1 + i])});
+        }
+        candidates.push_back(Neighbor{id, distance(targetQuery, id)});
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const Neighbor& a, const Neighbor& b) { return a.distance < b.distance; });
+        std::vector<Neighbor> selected = selectNeighbors(candidates, maxLinks(level));
+        list[0] = selected.size();
+        for (size_t i = 0; i < selected.size(); ++i) {
+            list[1 + i] = selected[i].id;
+        }
+    }
+
+    void insert(uint32_t id) {
+        int level = levels[id];
+        Query query = nodeQuery(id);
+
+        // A node above the current top level becomes the entry point; the entry lock is held
+        // through its whole insertion so no other insert starts from a half-linked top level
+        std::unique_lock<std::mutex> entryLock(entryMutex);
+        if (entryPoint == NONE) {
+            entryPoint = id;
+            maxLevel = level;
+            return;
+        }
+        uint32_t entry = entryPoint;
+        int top = maxLevel;
+        if (level <= top) {
+            entryLock.unlock();
+        }
+
+        Neighbor closest = descend(query, Neighbor{entry, distance(query, entry)}, top, level, true);
+        std::vector<Neighbor> entries{closest};
+        for (int l = std::min(level, top); l >= 0; --l) {
+            std::vector<Neighbor> candidates = searchLayer(query, entries, params.efConstruction, l, true);
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                            [id](const Neighbor& n) { return n.id == id; }),
+                             candidates.end());
+            std::vector<Neighbor> selected = selectNeighbors(candidates, params.M);
+            setLinks(id, l, selected);
+            for (const Neighbor& neighbor : selected) {
+                connect(neighbor.id, id, l);
+            }
+            if (!candidates.empty()) {
+                entries = candidates;
+            }
+        }
+
+        if (level > top) {
+            entryPoint = id;
+            maxLevel = level;
+        }
+    }
+
+    void refreshPointers() {
+        floatData = ownedFloats.data();
+        int8Data = ownedInt8.data();
+        scaleData = ownedScales.data();
+        normData = ownedNorms.data();
+        level0Data = ownedLevel0.data();
+    }
+
+    // Whether a link list read from a file (count, then ids) fits level and names only nodes
+    // of this index
+    bool validLinks(const uint32_t* list, int level) const {
+        if (list[0] > maxLinks(level)) {
+            return false;
+        }
+        for (uint32_t k = 1; k <= list[0]; ++k) {
+            if (list[k] >= count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Section offsets of the index file; every section starts at a multiple of SECTION_ALIGNMENT
+    struct FileLayout {
+        size_t vectors, scales, norms, level0, levels, upper;
+    };
+
+    FileLayout fileLayout() const {
+        const size_t HEADER_BYTES = 4 + 5 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(int32_t);
+        FileLayout layout;
+        layout.vectors = WeightFile::alignUp(HEADER_BYTES, SECTION_ALIGNMENT);
+        size_t vectorBytes = count * dim * (params.int8 ? sizeof(int8_t) : sizeof(float));
+        layout.scales = WeightFile::alignUp(layout.vectors + vectorBytes, SECTION_ALIGNMENT);
+        layout.norms = layout.scales + (params.int8 ? count * sizeof(float) : 0);
+        layout.level0 = WeightFile::alignUp(layout.norms + (params.int8 ? count * sizeof(float) : 0), SECTION_ALIGNMENT);
+        layout.levels = WeightFile::alignUp(layout.level0 + count * level0Stride() * sizeof(uint32_t), SECTION_ALIGNMENT);
+        layout.upper = WeightFile::alignUp(layout.levels + count * sizeof(int32_t), SECTION_ALIGNMENT);
+        return layout;
+    }
+
+    // Copies a mapped index into owned storage so it can grow
+    void detach() {
+        if (mapping == nullptr) {
+            return;
+        }
+        if (params.int8) {
+            ownedInt8.assign(int8Data, int8Data + count * dim);
+            ownedScales.assign(scaleData, scaleData + count);
+            ownedNorms.assign(normData, normData + count);
+        } else {
+            ownedFloats.assign(floatData, floatData + count * dim);
+        }
+        ownedLevel0.assign(level0Data, level0Data + count * level0Stride());
+#if defined(__linux__)
+        munmap(mapping, mappingBytes);
+#endif
+        mapping = nullptr;
+        refreshPointers();
+    }
+
+public:
+    HnswIndex(int dimension, const Params& indexParams)
+        : dim(dimension), params(indexParams), count(0), entryPoint(NONE), maxLevel(0),
+          mapping(nullptr), mappingBytes(0) {
+        refreshPointers();
+    }
+
+    explicit HnswIndex(int dimension) : HnswIndex(dimension, Params()) {}
+
+    // Maps an index written by save(); searches read vectors and level-0 links from the file
+    explicit HnswIndex(const std::string& path) : dim(0), count(0), entryPoint(NONE), maxLevel(0),
+                                                  mapping(nullptr), mappingBytes(0) {
+        refreshPointers();
+#if defined(__linux__)
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("cannot open index file " + path);
+        }
+        mappingBytes = info.st_size;
+        void* base = mappingBytes > 0 ? mmap(nullptr, mappingBytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (base == MAP_FAILED) {
+            throw std::runtime_error("cannot map index file " + path);
+        }
+        mapping = base;
+
+        const char* bytes = static_cast<const char*>(base);
+        uint32_t header[5];
+        uint64_t numVectors = 0;
+        int32_t topLevel = 0;
+        if (mappingBytes < fileLayout().vectors || std::memcmp(bytes, "HNSW", 4) != 0) {
+            munmap(mapping, mappingBytes);
+            throw std::runtime_error("not an index file: " + path);
+        }
+        std::memcpy(header, bytes + 4, sizeof(header));
+        std::memcpy(&numVectors, bytes + 4 + sizeof(header), sizeof(numVectors));
+        std::memcpy(&entryPoint, bytes + 4 + sizeof(header) + sizeof(numVectors), sizeof(entryPoint));
+        std::memcpy(&topLevel, bytes + 4 + sizeof(header) + sizeof(numVectors) + sizeof(entryPoint), sizeof(topLevel));
+        dim = header[1];
+        params.M = header[2];
+        params.int8 = header[3] != 0;
+        params.metric = static_cast<Metric>(header[4]);
+        count = numVectors;
+        maxLevel = topLevel;
+        auto reject = [this, &path](const char* problem) {
+            munmap(mapping, mappingBytes);
+            throw std::runtime_error(std::string(problem) + " index file " + path);
+        };
+        if (header[0] != FILE_VERSION) {
+            reject("unsupported");
+        }
+        // Every count x something section must fit the file, which also keeps fileLayout()
+        // from overflowing
+        size_t perVector = mappingBytes / std::max<size_t>(count, 1);
+        if (dim <= 0 || params.M <= 0 || header[4] > uint32_t(Metric::InnerProduct) || numVectors > mappingBytes ||
+            size_t(dim) > perVector || size_t(params.M) > perVector) {
+            reject("corrupt");
+        }
+        if (maxLevel < 0 || maxLevel > MAX_LEVEL || (count == 0 ? entryPoint != NONE : entryPoint >= count)) {
+            reject("corrupt");
+        }
+
+        FileLayout layout = fileLayout();
+        if (mappingBytes < layout.upper) {
+            reject("truncated");
+        }
+        floatData = reinterpret_cast<const float*>(bytes + layout.vectors);
+        int8Data = reinterpret_cast<const int8_t*>(bytes + layout.vectors);
+        scaleData = reinterpret_cast<const float*>(bytes + layout.scales);
+        normData = reinterpret_cast<const float*>(bytes + layout.norms);
+        level0Data = reinterpret_cast<const uint32_t*>(bytes + layout.level0);
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!validLinks(level0Data + i * level0Stride(), 0)) {
+                reject("corrupt");
+            }
+        }
+
+        // Upper levels are small; they are copied out of the mapping
+        const int32_t* fileLevels = reinterpret_cast<const int32_t*>(bytes + layout.levels);
+        const uint32_t* upper = reinterpret_cast<const uint32_t*>(bytes + layout.upper);
+        size_t upperLeft = (mappingBytes - layout.upper) / sizeof(uint32_t);
+        for (size_t i = 0; i < count; ++i) {
+            int level = fileLevels[i];
+            if (level < 0 || level > maxLevel) {
+                reject("corrupt");
+            }
+            size_t linkWords = level * upperStride();
+            if (linkWords > upperLeft) {
+                reject("truncated");
+            }
+            for (int l = 1; l <= level; ++l) {
+                if (!validLinks(upper + (l - 1) * upperStride(), l)) {
+                    reject("corrupt");
+                }
+            }
+            levels.push_back(level);
+            upperLinks.emplace_back(upper, upper + linkWords);
+            upper += linkWords;
+            upperLeft -= linkWords;
+            linkLocks.emplace_back();
+        }
+#else
+        throw std::runtime_error("index files can only be mapped on Linux: " + path);
+#endif
+    }
+
+    ~HnswIndex() {
+#if defined(__linux__)
+        if (mapping != nullptr) {
+            munmap(mapping, mappingBytes);
+        }
+#endif
+    }
+
+    HnswIndex(const HnswIndex&) = delete;
+    HnswIndex& operator=(const HnswIndex&) = delete;
+
+    size_t size() const {
+        return count;
+    }
+
+    int getDim() const {
+        return dim;
+    }
+
+    // Inserts the rows of vectors ([n x dim], row-major, e.g. from Transformer::embed) with
+    // ids size() .. size() + n - 1. Nodes are linked in parallel on the shared ThreadPool.
+    void add(const Vector& vectors) {
+        size_t n = vectors.size() / dim;
+        if (n == 0) {
+            return;
+        }
+        detach();
+        size_t first = count;
+        if (params.int8) {
+            QuantizedEmbeddings quantized = Utils::quantizeRows(vectors, dim);
+            ownedInt8.insert(ownedInt8.end(), quantized.values.begin(), quantized.values.begin() + n * dim);
+            ownedScales.insert(ownedScales.end(), quantized.scales.begin(), quantized.scales.end());
+            for (size_t i = 0; i < n; ++i) {
+                ownedNorms.push_back(Utils::dotProduct(&vectors[i * dim], &vectors[i * dim], dim));
+            }
+        } else {
+            ownedFloats.insert(ownedFloats.end(), vectors.begin(), vectors.begin() + n * dim);
+        }
+        ownedLevel0.resize((first + n) * level0Stride(), 0);
+        for (size_t i = 0; i < n; ++i) {
+            levels.push_back(randomLevel(first + i));
+            upperLinks.emplace_back(levels.back() * upperStride(), 0);
+            linkLocks.emplace_back();
+        }
+        count += n;
+        refreshPointers();
+
+        size_t begin = first;
+        if (entryPoint == NONE) {
+            insert(begin++);
+        }
+        ThreadPool::shared().parallelFor(begin, count, 16, [this](size_t tileBegin, size_t tileEnd) {
+            for (size_t id = tileBegin; id < tileEnd; ++id) {
+                insert(id);
+            }
+        });
+    }
+
+    // The k nearest stored vectors to query ([dim]), closest first. ef (default
+    // Params::efSearch) trades recall for speed and is raised to k when smaller.
+    std::vector<Neighbor> search(const float* query, size_t k, size_t ef = 0) const {
+        if (count == 0 || k == 0) {
+            return {};
+        }
+        Query prepared = prepare(query);
+        Neighbor entry = descend(prepared, Neighbor{entryPoint, distance(prepared, entryPoint)}, maxLevel, 0, false);
+        std::vector<Neighbor> found =
+            searchLayer(prepared, {entry}, std::max(k, ef > 0 ? ef : size_t(params.efSearch)), 0, false);
+        found.resize(std::min(k, found.size()));
+        return found;
+    }
+
+    // search() for every row of queries ([n x dim]), spread over the shared ThreadPool
+    std::vector<std::vector<Neighbor>> searchBatch(const Vector& queries, size_t k, size_t ef = 0) const {
+        size_t n = queries.size() / dim;
+        std::vector<std::vector<Neighbor>> results(n);
+        ThreadPool::shared().parallelFor(0, n, 8, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                results[i] = search(&queries[i * dim], k, ef);
+            }
+        });
+        return results;
+    }
+
+    // File layout (native byte order):
+    //   "HNSW" | uint32 version, dim, M, int8, metric | uint64 count | uint32 entry | int32 maxLevel
+    //   then, each section at a multiple of 64 bytes: vectors (float or int8), scales and norms
+    //   (int8 only), level-0 links, levels, upper-level links in id order
+    void save(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("cannot write index file " + path);
+        }
+        uint32_t header[5] = {FILE_VERSION, uint32_t(dim), uint32_t(params.M), params.int8 ? 1u : 0u,
+                              uint32_t(params.metric)};
+        uint64_t numVectors = count;
+        int32_t topLevel = maxLevel;
+        out.write("HNSW", 4);
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&numVectors), sizeof(numVectors));
+        out.write(reinterpret_cast<const char*>(&entryPoint), sizeof(entryPoint));
+        out.write(reinterpret_cast<const char*>(&topLevel), sizeof(topLevel));
+
+        FileLayout layout = fileLayout();
+        auto section = [&out](size_t offset, const void* data, size_t bytes) {
+            out.seekp(offset);
+            out.write(static_cast<const char*>(data), bytes);
+        };
+        if (params.int8) {
+            section(layout.vectors, int8Data, count * dim);
+            section(layout.scales, scaleData, count * sizeof(float));
+            section(layout.norms, normData, count * sizeof(float));
+        } else {
+            section(layout.vectors, floatData, count * dim * sizeof(float));
+        }
+        section(layout.level0, level0Data, count * level0Stride() * sizeof(uint32_t));
+        std::vector<int32_t> fileLevels(levels.begin(), levels.end());
+        section(layout.levels, fileLevels.data(), count * sizeof(int32_t));
+        out.seekp(layout.upper);
+        for (const auto& nodeLinks : upperLinks) {
+            out.write(reinterpret_cast<const char*>(nodeLinks.data()), nodeLinks.size() * sizeof(uint32_t));
+        }
+        if (!out) {
+            throw std::runtime_error("error writing index file " + path);
+        }
+    }
+};
+
+#endif // HNSW_INDEX_H
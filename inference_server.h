@@ -0,0 +1,425 @@
+#ifndef INFERENCE_SERVER_H
+#define INFERENCE_SERVER_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include "batch_scheduler.h"
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+// Serves generation requests over a Unix domain socket from one epoll thread, handing them to a
+// BatchScheduler and streaming every generated token back as soon as its step finishes.
+//
+// Frames in both directions are a little-endian u32 payload length followed by the payload.
+//   request:  u32 requestId, u32 maxTokens, i32 priority, u32 deadlineMs, u32 budgetMs,
+//             i32 adapter, UTF-8 text
+//   response: u32 requestId, u8 kind, UTF-8 text
+// priority and deadlineMs (relative to arrival, 0 for none) order the request in the
+// scheduler (see BatchScheduler); interactive traffic would send a higher priority than batch
+// backfill. budgetMs (0 for none) is a hard time budget: past it the request is cancelled and
+// gets an ERROR "cancelled" after whatever tokens it already produced; one whose batch failed
+// to generate gets an ERROR "failed". adapter picks the model
+// adapter to generate with (-1 for the base model); one the codec does not serve gets an
+// ERROR "unknown adapter" right away, and so does a request arriving while the scheduler's
+// queue is full, with ERROR "busy". kind is TOKEN (text is
+// the token), END (the request is done, text empty) or ERROR (text is the message). A client
+// may pipeline any number of requests on one connection; responses to different requests
+// interleave. Closing the connection (or its write side) cancels the requests still waiting or
+// generating on it, which leave the batch at the next step. A malformed frame gets an ERROR
+// with requestId 0 and the connection is closed, and so is a connection whose unread responses
+// pass MAX_PENDING_OUTPUT_BYTES (16 MB), after cancelling its requests: clients must keep reading.
+//
+// Client sockets are non-blocking and edge-triggered. Scheduler callbacks only append to the
+// connection's output buffer and wake the loop through an eventfd; all socket writes happen on
+// the loop thread, resuming on EPOLLOUT when the client reads slower than tokens arrive.
+class InferenceServer {
+public:
+    enum Kind : uint8_t { TOKEN = 0, END = 1, ERROR = 2 };
+
+    // Text <-> token ids, as the model sees them, and the adapters the model serves (every id
+    // when hasAdapter is empty)
+    struct Codec {
+        std::function<std::vector<int>(const std::string&)> encode;
+        std::function<std::string(int)> decode;
+        std::function<bool(int)> hasAdapter;
+    };
+
+    static const uint32_t MAX_FRAME_BYTES = 1 << 20;
+    static const uint32_t REQUEST_HEADER_BYTES = 24;
+    static const size_t MAX_PENDING_OUTPUT_BYTES = size_t(16) << 20; // per connection, see queueFrame
+
+private:
+    struct Connection {
+        int fd;
+        std::string input;
+        std::mutex mutex;   // guards output, closed and overflowed (appended to by the scheduler thread)
+        std::string output;
+        bool closed = false;
+        bool overflowed = false; // output passed MAX_PENDING_OUTPUT_BYTES; the loop closes it
+        CancellationToken cancel = CancellationToken::create(); // parent of its requests' tokens
+
+        explicit Connection(int socket) : fd(socket) {}
+    };
+
+    // Connections with output waiting to be written. Shared with the scheduler callbacks, so
+    // a request still generating after the server has gone writes into it harmlessly.
+    struct Outbox {
+        std::mutex mutex;
+        std::vector<std::weak_ptr<Connection>> dirty;
+        int eventFd;
+
+        explicit Outbox(int fd) : eventFd(fd) {}
+
+        ~Outbox() {
+            ::close(eventFd);
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            ssize_t written = ::write(eventFd, &one, sizeof(one));
+            (void)written;
+        }
+
+        void push(const std::shared_ptr<Connection>& connection) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                dirty.push_back(connection);
+            }
+            wake();
+        }
+    };
+
+    std::string socketPath;
+    BatchScheduler& scheduler;
+    Codec codec;
+    int listenFd;
+    int epollFd;
+    std::shared_ptr<Outbox> outbox;
+    std::unordered_map<int, std::shared_ptr<Connection>> connections;
+    std::atomic<bool> stopping;
+
+    static void appendU32(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    static uint32_t readU32(const char* bytes) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= uint32_t(static_cast<unsigned char>(bytes[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    static void appendFrame(std::string& out, uint32_t requestId, Kind kind, const std::string& text) {
+        appendU32(out, static_cast<uint32_t>(4 + 1 + text.size()));
+        appendU32(out, requestId);
+        out.push_back(static_cast<char>(kind));
+        out += text;
+    }
+
+    // Appends a frame to the connection's output. A client that leaves more than
+    // MAX_PENDING_OUTPUT_BYTES unread has its requests cancelled and is closed by the loop
+    // thread (see flush), so a reader that never reads cannot grow the server without bound.
+    static void queueFrame(const std::shared_ptr<Outbox>& outbox, const std::shared_ptr<Connection>& connection,
+                           uint32_t requestId, Kind kind, const std::string& text) {
+        {
+            std::lock_guard<std::mutex> lock(connection->mutex);
+            if (connection->closed || connection->overflowed) {
+                return;
+            }
+            appendFrame(connection->output, requestId, kind, text);
+            if (connection->output.size() > MAX_PENDING_OUTPUT_BYTES) {
+                connection->overflowed = true;
+                connection->output.clear();
+                connection->cancel.cancel();
+            }
+        }
+        outbox->push(connection);
+    }
+
+    void watch(int fd, uint32_t events) {
+        epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            throw std::runtime_error(std::string("epoll_ctl failed: ") + std::strerror(errno));
+        }
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return; // EAGAIN: no more pending connections (other errors: try again on the next event)
+            }
+            connections[fd] = std::make_shared<Connection>(fd);
+            watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+        }
+    }
+
+    void closeConnection(int fd) {
+        auto found = connections.find(fd);
+        if (found == connections.end()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(found->second->mutex);
+            found->second->closed = true;
+            found->second->output.clear();
+        }
+        found->second->cancel.cancel();
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections.erase(found);
+    }
+
+    // Writes as much pending output as the socket takes; false if the connection broke or
+    // overflowed its output cap
+    bool flush(Connection& connection) {
+        std::lock_guard<std::mutex> lock(connection.mutex);
+        if (connection.overflowed) {
+            return false;
+        }
+        size_t sent = 0;
+        while (sent < connection.output.size()) {
+            ssize_t n = ::send(connection.fd, connection.output.data() + sent, connection.output.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                break; // socket buffer full: the rest goes out on EPOLLOUT
+            }
+            sent += n;
+        }
+        connection.output.erase(0, sent);
+        return true;
+    }
+
+    // Reads everything available and submits each complete request; false if the connection
+    // was closed by the peer or has to be closed
+    bool receive(const std::shared_ptr<Connection>& connection) {
+        char buffer[64 * 1024];
+        bool open = true;
+        while (true) {
+            ssize_t n = ::recv(connection->fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection->input.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+
+        size_t offset = 0;
+        std::string& input = connection->input;
+        while (input.size() - offset >= 4) {
+            uint32_t length = readU32(input.data() + offset);
+            if (length < REQUEST_HEADER_BYTES || length > MAX_FRAME_BYTES) {
+                queueFrame(outbox, connection, 0, ERROR, "malformed frame");
+                flush(*connection);
+                return false;
+            }
+            if (input.size() - offset - 4 < length) {
+                break;
+            }
+            const char* payload = input.data() + offset + 4;
+            uint32_t requestId = readU32(payload);
+            uint32_t maxTokens = readU32(payload + 4);
+            int32_t priority = static_cast<int32_t>(readU32(payload + 8));
+            uint32_t deadlineMs = readU32(payload + 12);
+            uint32_t budgetMs = readU32(payload + 16);
+            int32_t adapter = static_cast<int32_t>(readU32(payload + 20));
+            submit(connection, requestId, maxTokens, priority, deadlineMs, budgetMs, adapter,
+                   std::string(payload + REQUEST_HEADER_BYTES, length - REQUEST_HEADER_BYTES));
+            offset += 4 + length;
+        }
+        input.erase(0, offset);
+        return open;
+    }
+
+    void submit(const std::shared_ptr<Connection>& connection, uint32_t requestId, uint32_t maxTokens,
+                int32_t priority, uint32_t deadlineMs, uint32_t budgetMs, int32_t adapter, const std::string& text) {
+        if (adapter != -1 && codec.hasAdapter && !codec.hasAdapter(adapter)) {
+            queueFrame(outbox, connection, requestId, ERROR, "unknown adapter");
+            return;
+        }
+        BatchScheduler::Request request;
+        request.adapter = adapter;
+        request.tokenIds = codec.encode(text);
+        request.maxNewTokens = static_cast<int>(std::min<uint32_t>(maxTokens, 1 << 20));
+        request.priority = priority;
+        if (deadlineMs > 0) {
+            request.deadline = BatchScheduler::Clock::now() + std::chrono::milliseconds(deadlineMs);
+        }
+        request.cancel = connection->cancel.child();
+        if (budgetMs > 0) {
+            request.cancel.setDeadline(CancellationToken::Clock::now() + std::chrono::milliseconds(budgetMs));
+        }
+        std::shared_ptr<Outbox> box = outbox;
+        std::function<std::string(int)> decode = codec.decode;
+        request.onToken = [box, connection, requestId, decode](int tokenId, BatchScheduler::Event event) {
+            if (tokenId >= 0) {
+                queueFrame(box, connection, requestId, TOKEN, decode(tokenId));
+            }
+            if (event == BatchScheduler::Event::Finished) {
+                queueFrame(box, connection, requestId, END, "");
+            } else if (event == BatchScheduler::Event::Cancelled) {
+                queueFrame(box, connection, requestId, ERROR, "cancelled");
+            } else if (event == BatchScheduler::Event::Failed) {
+                queueFrame(box, connection, requestId, ERROR, "failed");
+            }
+        };
+        // The loop thread must never wait for the scheduler to catch up
+        if (!scheduler.trySubmit(std::move(request))) {
+            queueFrame(outbox, connection, requestId, ERROR, "busy");
+        }
+    }
+
+    void flushDirty() {
+        std::vector<std::weak_ptr<Connection>> dirty;
+        {
+            std::lock_guard<std::mutex> lock(outbox->mutex);
+            dirty.swap(outbox->dirty);
+        }
+        for (const std::weak_ptr<Connection>& weak : dirty) {
+            std::shared_ptr<Connection> connection = weak.lock();
+            if (connection && connections.count(connection->fd) && connections[connection->fd] == connection &&
+                !flush(*connection)) {
+                closeConnection(connection->fd);
+            }
+        }
+    }
+
+    void closeAll() {
+        while (!connections.empty()) {
+            closeConnection(connections.begin()->first);
+        }
+        if (listenFd >= 0) {
+            ::close(listenFd);
+            ::unlink(socketPath.c_str());
+            listenFd = -1;
+        }
+        if (epollFd >= 0) {
+            ::close(epollFd);
+            epollFd = -1;
+        }
+    }
+
+public:
+    // Binds and listens on socketPath (an existing socket file there is replaced)
+    InferenceServer(const std::string& path, BatchScheduler& batchScheduler, const Codec& textCodec)
+        : socketPath(path), scheduler(batchScheduler), codec(textCodec), listenFd(-1), epollFd(-1), stopping(false) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd >= 0) {
+            outbox = std::make_shared<Outbox>(eventFd);
+        }
+        ::unlink(path.c_str());
+        if (listenFd < 0 || epollFd < 0 || !outbox ||
+            bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, 128) != 0) {
+            std::string error = std::strerror(errno);
+            closeAll();
+            throw std::runtime_error("Cannot listen on " + path + ": " + error);
+        }
+        watch(listenFd, EPOLLIN | EPOLLET);
+        watch(outbox->eventFd, EPOLLIN | EPOLLET);
+    }
+
+    ~InferenceServer() {
+        closeAll();
+    }
+
+    InferenceServer(const InferenceServer&) = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+
+    // Serves until stop(); requests still generating afterwards complete into closed connections
+    void run() {
+        epoll_event events[64];
+        while (!stopping.load()) {
+            int count = epoll_wait(epollFd, events, 64, -1);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("epoll_wait failed: ") + std::strerror(errno));
+            }
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptAll();
+                    continue;
+                }
+                if (fd == outbox->eventFd) {
+                    uint64_t wakeups;
+                    ssize_t drained = ::read(fd, &wakeups, sizeof(wakeups));
+                    (void)drained;
+                    flushDirty();
+                    continue;
+                }
+                auto found = connections.find(fd);
+                if (found == connections.end()) {
+                    continue;
+                }
+                std::shared_ptr<Connection> connection = found->second;
+                bool open = !(events[i].events & (EPOLLERR | EPOLLHUP));
+                if (open && (events[i].events & EPOLLIN)) {
+                    open = receive(connection);
+                }
+                if (open && (events[i].events & EPOLLOUT)) {
+                    open = flush(*connection);
+                }
+                if (!open) {
+                    closeConnection(fd);
+                }
+            }
+        }
+        while (!connections.empty()) {
+            closeConnection(connections.begin()->first);
+        }
+    }
+
+    // Makes run() return; safe to call from any thread or a signal handler
+    void stop() {
+        stopping.store(true);
+        if (outbox) {
+            outbox->wake();
+        }
+    }
+};
+
+#endif // __linux__
+
+#endif // INFERENCE_SERVER_H
@@ -0,0 +1,184 @@
+#ifndef LORA_H
+#define LORA_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include "transformer_types.h"
+#include "thread_pool.h"
+
+// Adapter id of every row of a batch (NO_ADAPTER: base weights only). Empty means no row has
+// one; rows of a packed sequence normally share the adapter of that sequence's request.
+typedef std::vector<int> RowAdapters;
+
+const int NO_ADAPTER = -1;
+
+// Which weight matrices of a layer an adapter attaches to
+enum LoraTarget : unsigned {
+    LORA_QUERY = 1,
+    LORA_KEY = 2,
+    LORA_VALUE = 4,
+    LORA_OUTPUT = 8,
+    LORA_FFN1 = 16,
+    LORA_FFN2 = 32,
+    LORA_ALL = 63
+};
+
+struct LoraConfig {
+    int rank = 8;
+    float alpha = 16.0f; // deltas are scaled by alpha / rank
+    unsigned targets = LORA_ALL;
+};
+
+namespace Utils {
+
+    // Per-row adapter ids of a packed batch whose sequence s uses sequenceAdapters[s]; empty
+    // when no sequence has an adapter, so a base-only batch keeps the base-only path
+    RowAdapters adapterRows(const SequenceOffsets& sequences, const std::vector<int>& sequenceAdapters) {
+        RowAdapters rows;
+        if (std::all_of(sequenceAdapters.begin(), sequenceAdapters.end(), [](int id) { return id == NO_ADAPTER; })) {
+            return rows;
+        }
+        if (sequences.size() != sequenceAdapters.size() + 1) {
+            throw std::invalid_argument("adapterRows: one adapter id per sequence expected");
+        }
+        rows.reserve(sequences.back());
+        for (size_t s = 0; s < sequenceAdapters.size(); ++s) {
+            rows.insert(rows.end(), sequences[s + 1] - sequences[s], sequenceAdapters[s]);
+        }
+        return rows;
+    }
+
+}
+
+// Rank-r deltas of one weight matrix W (in x out), one pair of factors per adapter:
+//   x * W  becomes  x * W + scale * (x * A) * B,   A: in x rank, B: rank x out
+// W itself is never touched, so one resident base serves every adapter. After the base
+// product has run over a mixed batch, addDelta() groups the rows by adapter and runs two small
+// GEMMs per group, so A and B are fetched once per group and stay in cache for its rows.
+// Adapters are added and removed between passes, not while one runs.
+class LoraDeltas {
+private:
+    struct Adapter {
+        Vector At; // A transposed, [rank x inDim], so each row of X * A is rank dot products
+        Vector B;  // [rank x outDim]
+        int rank;
+        float scale;
+    };
+
+    size_t inDim;
+    size_t outDim;
+    std::unordered_map<int, Adapter> adapters;
+
+    // output[rows[g] - begin] += scale * (input[rows[g]] * A) * B for every g in [first, last)
+    void addGroup(const Adapter& adapter, const Matrix& input, const std::vector<size_t>& rows, size_t first,
+                  size_t last, size_t begin, Vector* output, Vector& projected) const {
+        size_t count = last - first;
+        size_t rank = adapter.rank;
+        projected.resize(count * rank);
+        // projected = X * A; A (rank x inDim floats) stays in cache across the group
+        for (size_t g = 0; g < count; ++g) {
+            const float* x = input[rows[first + g]].data();
+            for (size_t j = 0; j < rank; ++j) {
+                projected[g * rank + j] = Utils::dotProduct(x, adapter.At.data() + j * inDim, inDim);
+            }
+        }
+        // output += scale * projected * B, one row of B at a time across the group
+        for (size_t j = 0; j < rank; ++j) {
+            const float* row = adapter.B.data() + j * outDim;
+            for (size_t g = 0; g < count; ++g) {
+                Utils::axpy(output[rows[first + g] - begin].data(), adapter.scale * projected[g * rank + j], row, outDim);
+            }
+        }
+    }
+
+public:
+    LoraDeltas() : inDim(0), outDim(0) {}
+
+    void setShape(size_t in, size_t out) {
+        inDim = in;
+        outDim = out;
+    }
+
+    // Attaches (or replaces) adapter id; A is inDim x rank and B rank x outDim, row-major
+    void add(int id, Vector A, Vector B, int rank, float scale) {
+        if (id == NO_ADAPTER || rank <= 0 || A.size() != inDim * rank || B.size() != size_t(rank) * outDim) {
+            throw std::invalid_argument("LoraDeltas: bad adapter id or factor shapes");
+        }
+        Vector At(A.size());
+        for (size_t k = 0; k < inDim; ++k) {
+            for (int j = 0; j < rank; ++j) {
+                At[j * inDim + k] = A[k * rank + j];
+            }
+        }
+        adapters[id] = Adapter{std::move(At), std::move(B), rank, scale};
+    }
+
+    // Attaches adapter id with factors whose values depend only on key (as initializeMatrix)
+    void initialize(int id, const LoraConfig& config, uint64_t key) {
+        if (config.rank <= 0) {
+            throw std::invalid_argument("LoraDeltas: rank must be positive");
+        }
+        Vector factors[2] = {Vector(inDim * config.rank), Vector(size_t(config.rank) * outDim)};
+        for (int f = 0; f < 2; ++f) {
+            uint64_t factorKey = Utils::childKey(key, f);
+            for (size_t e = 0; e < factors[f].size(); ++e) {
+                uint64_t bits = Utils::splitmix64(factorKey + e) >> 40; // 24 bits
+                factors[f][e] = bits * (1.0f / (1 << 24)) - 0.5f;
+            }
+        }
+        add(id, std::move(factors[0]), std::move(factors[1]), config.rank, config.alpha / config.rank);
+    }
+
+    void remove(int id) {
+        adapters.erase(id);
+    }
+
+    // Whether addDelta() can change anything for a batch with these row adapters
+    bool active(const RowAdapters& rowAdapters) const {
+        return !adapters.empty() && !rowAdapters.empty();
+    }
+
+    // Adds the delta of each row in [begin, end) of input to output[row - begin]. Rows without
+    // an adapter, or with one this matrix has no factors for, are left as they are.
+    void addDelta(const Matrix& input, const RowAdapters& rowAdapters, size_t begin, size_t end, Vector* output) const {
+        if (!active(rowAdapters)) {
+            return;
+        }
+        std::vector<size_t> rows;
+        for (size_t i = begin; i < end; ++i) {
+            if (rowAdapters[i] != NO_ADAPTER) {
+                rows.push_back(i);
+            }
+        }
+        // Packed sequences keep a group's rows adjacent already; the sort only merges repeats
+        std::stable_sort(rows.begin(), rows.end(), [&rowAdapters](size_t a, size_t b) {
+            return rowAdapters[a] < rowAdapters[b];
+        });
+        Vector projected;
+        for (size_t first = 0, last; first < rows.size(); first = last) {
+            int id = rowAdapters[rows[first]];
+            for (last = first + 1; last < rows.size() && rowAdapters[rows[last]] == id; ++last) {
+            }
+            auto found = adapters.find(id);
+            if (found != adapters.end()) {
+                addGroup(found->second, input, rows, first, last, begin, output, projected);
+            }
+        }
+    }
+
+    // addDelta over every row of input, in row tiles on the pool
+    void addDeltaRows(const Matrix& input, const RowAdapters& rowAdapters, Matrix& output) const {
+        if (!active(rowAdapters)) {
+            return;
+        }
+        ThreadPool::shared().parallelFor(0, input.size(), ThreadPool::grainForRowWidth(inDim + outDim),
+                                         [&](size_t begin, size_t end) {
+            addDelta(input, rowAdapters, begin, end, output.data() + begin);
+        });
+    }
+};
+
+#endif // LORA_H
@@ -6,11 +6,23 @@
 #include <algorithm>
 #include <iomanip>
 #include <map>
+#include <cstdlib>
+#include <functional>
+#include <csignal>
+#include <limits>
+#include <stdexcept>
+#include <cstring>
 
 #include "transformer_types.h"
 #include "self_attention.h"
 #include "transformer_layers.h"
 #include "tokenizer_embeddings.h"
+#include "encoder_cache.h"
+#include "semantic_cache.h"
+#include "batch_scheduler.h"
+#include "inference_server.h"
+#include "bulk_scorer.h"
+#include "benchmark.h"
 
 // Main Transformer class
 class Transformer {
@@ -19,61 +31,181 @@ private:
     Embeddings embeddings;
     Encoder encoder;
     Decoder decoder;
-    Matrix outputLayerWeights; // For final prediction
+    WeightMatrix outputLayerWeights; // For final prediction
+    WeightMatrix relevanceHead; // embeddingDim x 1, pooled [query; passage] -> relevance (see rerank())
     int embeddingDim;
     int vocabSize;
+    uint64_t seed; // every component's weights derive from it and its path (see Utils::componentKey)
+    ShardedLruCache<Matrix> encoderCache; // token ids -> encoder output
+    SingleFlight<Matrix> encoderFlights;  // concurrent encodes of the same token ids share one pass
+    SingleFlight<Vector> pooledFlights;   // the same for pooled batches (see poolBatch)
+    std::unique_ptr<SemanticCache<std::string>> semanticCache; // optional, see enableSemanticCache()
+    SemanticCache<std::string>::Params semanticCacheParams;
+    size_t probeLayers; // encoder layers behind the semantic cache's embeddings
+    ModelLoader loader; // Declared last: its destructor finishes pending layer jobs first
 
-public:
-    Transformer(int embedDim, int numHeads, int ffnHiddenDim, int numLayers, int maxSeqLen)
-        : embeddings(1, embedDim, maxSeqLen), // Vocab size will be updated after tokenization
-          encoder(numLayers, embedDim, numHeads, ffnHiddenDim),
-          decoder(numLayers, embedDim, numHeads, ffnHiddenDim),
-          embeddingDim(embedDim) {
-        // Initialize output layer weights (vocab_size x embedding_dim)
-        // Will be re-initialized after tokenizer builds vocabulary
+    // Encoder input row for a token at a position
+    Vector tokenEmbedding(int tokenIdx, int position) {
+        if (tokenIdx == -1) {
+            // Handle unknown tokens, e.g., by assigning a special <unk> embedding
+            // For now, we'll just use a zero vector or skip.
+            return Vector(embeddingDim, 0.0f);
+        }
+        return embeddings.getEmbedding(tokenIdx, position);
     }
 
-    void build(const std::vector<std::string>& corpus) {
-        tokenizer.buildVocabulary(corpus);
-        vocabSize = tokenizer.getVocabSize();
-        
-        // Re-initialize embeddings and output layer with correct vocab size
-        embeddings = Embeddings(vocabSize, embeddingDim, embeddings.getMaxSequenceLength());
-        Utils::initializeMatrix(outputLayerWeights, embeddingDim, vocabSize);
+    // The tokens of tokenIds that fit the positional table: its first maximum-sequence-length
+    // tokens, or its last ones with keepLast
+    std::vector<int> windowTokens(const std::vector<int>& tokenIds, bool keepLast) {
+        size_t length = std::min<size_t>(tokenIds.size(), embeddings.getMaxSequenceLength());
+        auto first = tokenIds.begin() + (keepLast ? tokenIds.size() - length : 0);
+        return std::vector<int>(first, first + length);
     }
 
-    // Simplified prediction for a given input sequence
-    std::string predictNextWord(const std::string& sentence) {
-        std::istringstream iss(sentence);
-        std::string word;
-        std::vector<std::string> tokens;
-        while (iss >> word) {
-            tokens.push_back(word);
+    // Every sequence's token rows back to back, positions restarting at 0 for each one, with
+    // the offsets of each sequence in sequences. Sequences must fit the positional table
+    // (see windowTokens).
+    Matrix packTokens(const std::vector<std::vector<int>>& batch, SequenceOffsets& sequences) {
+        Matrix packed;
+        sequences.assign(1, 0);
+        for (const std::vector<int>& tokenIds : batch) {
+            for (size_t i = 0; i < tokenIds.size(); ++i) {
+                packed.push_back(tokenEmbedding(tokenIds[i], i));
+            }
+            sequences.push_back(packed.size());
         }
+        return packed;
+    }
 
-        if (tokens.empty()) return "";
+    // pooledFlights key of a sequence pooled with pooling under adapter: the token ids, then a
+    // marker no token id can take, the adapter id and the pooling mode
+    static std::vector<int> pooledKey(const std::vector<int>& tokenIds, int adapter, Pooling pooling) {
+        std::vector<int> key = tokenIds;
+        key.push_back(std::numeric_limits<int>::min());
+        key.push_back(adapter);
+        key.push_back(static_cast<int>(pooling));
+        return key;
+    }
 
-        // Prepare encoder input
-        Matrix encoderInput(tokens.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            int tokenIdx = tokenizer.encode(tokens[i]);
-            if (tokenIdx == -1) {
-                std::cerr << "Warning: Unknown token \"" << tokens[i] << "\"\n";
-                // Handle unknown tokens, e.g., by assigning a special <unk> embedding
-                // For now, we'll just use a zero vector or skip.
-                encoderInput[i].assign(embeddingDim, 0.0f);
-            } else {
-                encoderInput[i] = embeddings.getEmbedding(tokenIdx, i);
+    // Pooled encoder outputs of windows[s] under adapterIds[s] (empty: the base model for all),
+    // [windows.size() x embeddingDim] with zeros for empty windows. Each distinct (sequence,
+    // adapter, pooling) triple is encoded once, and one another call is encoding is shared from
+    // its flight. The rest go through one packed encoder pass that pools in the last layer's
+    // epilogue, so no per-token rows are kept; nothing goes into encoderCache, since generation
+    // windows and bulk lines are rarely seen twice.
+    Vector poolBatch(const std::vector<std::vector<int>>& windows, const std::vector<int>& adapterIds,
+                     Pooling pooling) {
+        auto adapterOf = [&adapterIds](size_t s) { return adapterIds.empty() ? NO_ADAPTER : adapterIds[s]; };
+        std::vector<std::vector<int>> keys;
+        std::vector<size_t> owners; // keys[k] belongs to windows[owners[k]]
+        for (size_t s = 0; s < windows.size(); ++s) {
+            if (!windows[s].empty()) {
+                keys.push_back(pooledKey(windows[s], adapterOf(s), pooling));
+                owners.push_back(s);
+            }
+        }
+        std::vector<std::shared_ptr<const Vector>> rows =
+            pooledFlights.runBatch(keys, [&](const std::vector<size_t>& leading) {
+            std::vector<std::vector<int>> batch;
+            std::vector<int> batchAdapters;
+            for (size_t k : leading) {
+                batch.push_back(windows[owners[k]]);
+                batchAdapters.push_back(adapterOf(owners[k]));
+            }
+            SequenceOffsets sequences;
+            Matrix packed = packTokens(batch, sequences);
+            SequencePooler pooler(pooling, sequences, embeddingDim);
+            encoder.forward(packed, sequences, pooler, std::numeric_limits<size_t>::max(),
+                            Utils::adapterRows(sequences, batchAdapters));
+            Vector pooled = pooler.result();
+            std::vector<std::shared_ptr<const Vector>> values;
+            for (size_t j = 0; j < batch.size(); ++j) {
+                values.push_back(std::make_shared<const Vector>(pooled.begin() + j * embeddingDim,
+                                                                pooled.begin() + (j + 1) * embeddingDim));
             }
+            return values;
+        });
+        Vector pooled(windows.size() * embeddingDim, 0.0f);
+        for (size_t k = 0; k < owners.size(); ++k) {
+            std::copy(rows[k]->begin(), rows[k]->end(), pooled.begin() + owners[k] * embeddingDim);
         }
+        return pooled;
+    }
 
-        // Run through encoder
-        Matrix encoderOutput = encoder.forward(encoderInput);
+    // Encoder output for a token sequence, from encoderCache when the same sequence was seen
+    // before, or from the pass another thread is already running for it
+    std::shared_ptr<const Matrix> encode(const std::vector<int>& tokenIds) {
+        if (std::shared_ptr<const Matrix> cached = encoderCache.get(tokenIds)) {
+            return cached;
+        }
+        return encoderFlights.run(tokenIds, [this, &tokenIds] {
+            // A flight that finished after the lookup above has cached its output
+            if (std::shared_ptr<const Matrix> cached = encoderCache.get(tokenIds)) {
+                return cached;
+            }
+            Matrix encoderInput(tokenIds.size());
+            for (size_t i = 0; i < tokenIds.size(); ++i) {
+                encoderInput[i] = tokenEmbedding(tokenIds[i], i);
+            }
+            auto encoderOutput = std::make_shared<const Matrix>(encoder.forward(encoderInput));
+            encoderCache.put(tokenIds, encoderOutput, Utils::matrixBytes(*encoderOutput));
+            return std::shared_ptr<const Matrix>(encoderOutput);
+        });
+    }
+
+    // Cheap sentence embedding for the semantic cache: mean-pooled output of the first
+    // probeLayers encoder layers over the first maximum-sequence-length tokens, L2-normalized
+    Vector probeEmbedding(const std::vector<int>& tokenIds) {
+        Matrix input(std::min<size_t>(tokenIds.size(), embeddings.getMaxSequenceLength()));
+        for (size_t i = 0; i < input.size(); ++i) {
+            input[i] = tokenEmbedding(tokenIds[i], i);
+        }
+        SequenceOffsets sequences = {0, input.size()};
+        SequencePooler pooler(Pooling::Mean, sequences, embeddingDim);
+        encoder.forward(input, sequences, pooler, probeLayers);
+        Vector embedding = pooler.result();
+        Utils::normalizeRows(embedding, embeddingDim);
+        return embedding;
+    }
+
+    // A causal pass has no streaming form: every input position must fit the positional table
+    void checkCausalLength(size_t inputTokens) {
+        if (inputTokens > (size_t)embeddings.getMaxSequenceLength()) {
+            throw std::out_of_range("causal pass over " + std::to_string(inputTokens) +
+                                    " tokens beyond the maximum sequence length " +
+                                    std::to_string(embeddings.getMaxSequenceLength()));
+        }
+    }
+
+    // log P(targets[i]) under the output layer applied to rows[i]; -infinity for unknown targets
+    std::vector<float> targetLogProbs(const Matrix& rows, const std::vector<int>& targets) {
+        std::vector<float> logProbs(rows.size());
+        ThreadPool::shared().parallelFor(0, rows.size(), ThreadPool::grainForRowWidth(embeddingDim * vocabSize),
+                                         [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (targets[i] < 0) {
+                    logProbs[i] = -std::numeric_limits<float>::infinity();
+                    continue;
+                }
+                logProbs[i] = Utils::logSoftmax(Utils::matMul(rows[i], outputLayerWeights))[targets[i]];
+            }
+        });
+        return logProbs;
+    }
+
+    std::string predictFromTokens(const std::vector<int>& tokenIds) {
+        // Run through encoder (or take a cached output for the same tokens); inputs longer
+        // than the positional table are streamed and only the last row is kept
+        Vector lastEncoderOutput;
+        if ((int)tokenIds.size() > embeddings.getMaxSequenceLength()) {
+            encodeStream(tokenIds, [&lastEncoderOutput](size_t, const Matrix& rows) { lastEncoderOutput = rows.back(); });
+        } else {
+            lastEncoderOutput = encode(tokenIds)->back();
+        }
 
         // Simplified decoder for next word prediction
         // We'll use the last encoder output as context for prediction
         // In a real scenario, the decoder would generate token by token.
-        Vector lastEncoderOutput = encoderOutput[encoderOutput.size() - 1];
 
         // Apply output layer to get logits
         Vector logits = Utils::matMul(lastEncoderOutput, outputLayerWeights);
@@ -93,9 +225,383 @@ public:
 
         return tokenizer.decode(predictedIndex);
     }
+
+public:
+    // encoderCacheBytes bounds the encoder output cache (0 disables it). Models built with the
+    // same modelSeed have the same weights.
+    Transformer(int embedDim, int numHeads, int ffnHiddenDim, int numLayers, int maxSeqLen,
+                size_t encoderCacheBytes = size_t(64) << 20, uint64_t modelSeed = Utils::DEFAULT_MODEL_SEED)
+        : embeddings(1, embedDim, maxSeqLen, Utils::componentKey(modelSeed, "embeddings")), // Vocab size will be updated after tokenization
+          encoder(numLayers, embedDim, numHeads, ffnHiddenDim, false, Utils::componentKey(modelSeed, "encoder")),
+          decoder(numLayers, embedDim, numHeads, ffnHiddenDim, false, Utils::componentKey(modelSeed, "decoder")),
+          embeddingDim(embedDim),
+          seed(modelSeed),
+          encoderCache(encoderCacheBytes),
+          probeLayers(1) {
+        // Encoder/decoder layers are filled in on the loader threads while the caller goes on
+        // to build(); a forward pass only waits for the layers it has reached.
+        encoder.initializeWeightsAsync(loader);
+        decoder.initializeWeightsAsync(loader);
+        // Initialize output layer weights (vocab_size x embedding_dim)
+        // Will be re-initialized after tokenizer builds vocabulary
+    }
+
+    void build(const std::vector<std::string>& corpus) {
+        tokenizer.buildVocabulary(corpus);
+        vocabSize = tokenizer.getVocabSize();
+        
+        // Re-initialize embeddings and output layer with correct vocab size
+        embeddings = Embeddings(vocabSize, embeddingDim, embeddings.getMaxSequenceLength(),
+                                Utils::componentKey(seed, "embeddings"));
+        Utils::initializeMatrix(outputLayerWeights, embeddingDim, vocabSize, Utils::componentKey(seed, "output"));
+        Utils::initializeMatrix(relevanceHead, embeddingDim, 1, Utils::componentKey(seed, "relevance"));
+        encoderCache.clear(); // outputs of the old embeddings
+        if (semanticCache) {
+            enableSemanticCache(semanticCacheParams, probeLayers);
+        }
+    }
+
+    // Runs one sequence of each length in sequenceBuckets (capped at the maximum sequence
+    // length) through the encoder, decoder and output layer, after pre-faulting the weight
+    // and KV arenas and sizing every pool thread's attention scratch for the largest bucket.
+    // The KV block pool keeps the blocks these passes used, so the first real requests
+    // find warm pages, pools and scratch. Call after build().
+    void warmup(const std::vector<int>& sequenceBuckets) {
+        waitUntilReady();
+        int largest = 0;
+        for (int bucket : sequenceBuckets) {
+            largest = std::max(largest, std::min(bucket, embeddings.getMaxSequenceLength()));
+        }
+        if (largest <= 0 || vocabSize <= 0) {
+            return;
+        }
+
+        HugePageArena::weights().prefault();
+        HugePageArena::kvCache().prefault();
+        ThreadPool::shared().forEachThread([largest] { MultiHeadSelfAttention::reserveScratch(largest); });
+
+        for (int bucket : sequenceBuckets) {
+            int seqLen = std::min(bucket, embeddings.getMaxSequenceLength());
+            if (seqLen <= 0) {
+                continue;
+            }
+            Matrix input(seqLen);
+            for (int i = 0; i < seqLen; ++i) {
+                input[i] = embeddings.getEmbedding(0, i);
+            }
+            Matrix encoderOutput = encoder.forward(input);
+            decoder.forward(input, encoderOutput);
+            Utils::softmax(Utils::matMul(encoderOutput.back(), outputLayerWeights));
+        }
+    }
+
+    // Attaches LoRA adapter id to the encoder (see Encoder::addAdapter); embedTokens and
+    // predictBatch then serve it next to the base model and every other adapter, over one
+    // copy of the base weights. Not while a request is running.
+    void addAdapter(int id, const LoraConfig& config = LoraConfig()) {
+        encoder.addAdapter(id, config);
+    }
+
+    void removeAdapter(int id) {
+        encoder.removeAdapter(id);
+    }
+
+    bool hasAdapter(int id) const {
+        return encoder.hasAdapter(id);
+    }
+
+    // Blocks until every layer has its weights
+    void waitUntilReady() {
+        encoder.waitUntilReady();
+        decoder.waitUntilReady();
+    }
+
+    // Sentence embeddings for a batch: every sentence goes through one packed encoder pass
+    // (sentences do not attend to each other; repeats run once, see poolBatch) and the last
+    // layer's rows are pooled as they are produced. Returns [sentences.size() x embeddingDim],
+    // row-major, optionally with unit L2 norm.
+    Vector embed(const std::vector<std::string>& sentences, Pooling pooling = Pooling::Mean, bool normalize = false) {
+        std::vector<std::vector<int>> batch;
+        for (const std::string& sentence : sentences) {
+            batch.push_back(tokenize(sentence));
+        }
+        return embedTokens(batch, pooling, normalize);
+    }
+
+    // embed() for token-id sequences; keepLast pools the last maximum-sequence-length tokens
+    // of longer sequences instead of the first ones. Empty sequences embed to zeros. A
+    // non-empty adapterIds runs batch[s] under adapter adapterIds[s] (NO_ADAPTER: the base
+    // model), all of them in the same packed pass.
+    Vector embedTokens(const std::vector<std::vector<int>>& batch, Pooling pooling = Pooling::Mean,
+                       bool normalize = false, bool keepLast = false, const std::vector<int>& adapterIds = {}) {
+        if (!adapterIds.empty() && adapterIds.size() != batch.size()) {
+            throw std::invalid_argument("embedTokens: one adapter id per sequence expected");
+        }
+        for (int id : adapterIds) {
+            if (id != NO_ADAPTER && !encoder.hasAdapter(id)) {
+                throw std::invalid_argument("embedTokens: unknown adapter " + std::to_string(id));
+            }
+        }
+        std::vector<std::vector<int>> windows;
+        for (const std::vector<int>& tokenIds : batch) {
+            windows.push_back(windowTokens(tokenIds, keepLast));
+        }
+        Vector pooled = poolBatch(windows, adapterIds, pooling);
+        if (normalize) {
+            Utils::normalizeRows(pooled, embeddingDim);
+        }
+        return pooled;
+    }
+
+    // embed() with each row quantized to int8 (4x smaller, for storage or int8 search)
+    QuantizedEmbeddings embedQuantized(const std::vector<std::string>& sentences,
+                                       Pooling pooling = Pooling::Mean, bool normalize = true) {
+        return Utils::quantizeRows(embed(sentences, pooling, normalize), embeddingDim);
+    }
+
+    // Encodes an input of any length in windows no longer than the positional table. Each
+    // window is a chunk of new tokens preceded by the last overlap tokens of the previous
+    // chunk, all encoded together at positions 0..window-1: the overlap is recomputed at its
+    // new positions rather than reusing keys/values encoded at the old ones, so positions
+    // within a window are always distinct and in order. emit(firstToken, rows) receives the
+    // new tokens' output rows of every window in order, so memory stays constant whatever the
+    // input length. Checks the current CancellationToken between windows.
+    void encodeStream(const std::vector<int>& tokenIds, const std::function<void(size_t, const Matrix&)>& emit) {
+        size_t window = embeddings.getMaxSequenceLength();
+        size_t overlap = window / 4;
+        size_t chunk = window - overlap;
+        for (size_t begin = 0; begin < tokenIds.size(); begin += chunk) {
+            CancellationToken::throwIfCurrentCancelled();
+            size_t first = begin - std::min(begin, overlap); // context recomputed from the previous chunk
+            size_t end = std::min(tokenIds.size(), begin + chunk);
+            Matrix input(end - first);
+            for (size_t i = first; i < end; ++i) {
+                input[i - first] = tokenEmbedding(tokenIds[i], i - first);
+            }
+            Matrix output = encoder.forward(input);
+            emit(begin, Matrix(output.begin() + (begin - first), output.end()));
+        }
+    }
+
+    // Whitespace-separated words of sentence as token ids (-1 for words not in the vocabulary)
+    std::vector<int> tokenize(const std::string& sentence, bool warnUnknown = true) {
+        std::istringstream iss(sentence);
+        std::string word;
+        std::vector<int> tokenIds;
+        while (iss >> word) {
+            int tokenIdx = tokenizer.encode(word);
+            if (tokenIdx == -1 && warnUnknown) {
+                std::cerr << "Warning: Unknown token \"" << word << "\"\n";
+            }
+            tokenIds.push_back(tokenIdx);
+        }
+        return tokenIds;
+    }
+
+    std::string decodeToken(int tokenIdx) {
+        return tokenizer.decode(tokenIdx);
+    }
+
+    // One generation step for a batch of token sequences: the most likely next token id of each.
+    // Every sequence's last maximum-sequence-length tokens are encoded as in embedTokens (one
+    // packed pass keeping only each sequence's last row; repeats and sequences another step is
+    // already encoding are left out). adapterIds as in embedTokens.
+    std::vector<int> predictBatch(const std::vector<std::vector<int>>& batch, const std::vector<int>& adapterIds = {}) {
+        Vector lastRows = embedTokens(batch, Pooling::Last, false, true, adapterIds);
+        std::vector<int> predicted(batch.size());
+        for (size_t s = 0; s < batch.size(); ++s) {
+            Vector lastEncoderOutput(lastRows.begin() + s * embeddingDim, lastRows.begin() + (s + 1) * embeddingDim);
+            Vector logits = Utils::matMul(lastEncoderOutput, outputLayerWeights);
+            predicted[s] = std::max_element(logits.begin(), logits.end()) - logits.begin();
+        }
+        return predicted;
+    }
+
+    // Per-token log-likelihood from one causal pass over the encoder layers (see
+    // Encoder::forwardCausal): entry i is log P(tokenIds[i + 1] | tokenIds[0..i]), so the first
+    // token, having no context, gets no entry. Unknown tokens (-1) score -infinity as targets.
+    std::vector<float> score(const std::vector<int>& tokenIds) {
+        if (tokenIds.size() < 2) {
+            return std::vector<float>();
+        }
+        checkCausalLength(tokenIds.size() - 1);
+        Matrix input(tokenIds.size() - 1);
+        for (size_t i = 0; i + 1 < tokenIds.size(); ++i) {
+            input[i] = tokenEmbedding(tokenIds[i], i);
+        }
+        Encoder::StreamState state = encoder.createStreamState();
+        Matrix rows = encoder.forwardCausal(input, state);
+        return targetLogProbs(rows, std::vector<int>(tokenIds.begin() + 1, tokenIds.end()));
+    }
+
+    std::vector<float> score(const std::string& sentence) {
+        return score(tokenize(sentence));
+    }
+
+    // score() for several candidate continuations of one prefix, with the prefix encoded once:
+    // its keys/values stay in each layer's cache and all continuations then go through a
+    // single packed causal pass, each attending to the prefix and to itself only. Entry k of
+    // result c is log P(continuations[c][k] | prefix, continuations[c][0..k)).
+    std::vector<std::vector<float>> scoreContinuations(const std::vector<int>& prefix,
+                                                       const std::vector<std::vector<int>>& continuations) {
+        if (prefix.empty()) {
+            throw std::invalid_argument("scoreContinuations: the prefix must not be empty");
+        }
+        size_t longest = 0;
+        for (const std::vector<int>& continuation : continuations) {
+            longest = std::max(longest, continuation.size());
+        }
+        checkCausalLength(prefix.size() + std::max<size_t>(longest, 1) - 1);
+
+        Encoder::StreamState state = encoder.createStreamState();
+        Matrix prefixInput(prefix.size());
+        for (size_t i = 0; i < prefix.size(); ++i) {
+            prefixInput[i] = tokenEmbedding(prefix[i], i);
+        }
+        Vector firstLogProbs = Utils::logSoftmax(Utils::matMul(encoder.forwardCausal(prefixInput, state).back(),
+                                                               outputLayerWeights));
+
+        // Every continuation but its last token (whose row would predict past the end), packed
+        Matrix packed;
+        SequenceOffsets sequences(1, 0);
+        std::vector<int> targets;
+        for (const std::vector<int>& continuation : continuations) {
+            for (size_t k = 0; k + 1 < continuation.size(); ++k) {
+                packed.push_back(tokenEmbedding(continuation[k], prefix.size() + k));
+                targets.push_back(continuation[k + 1]);
+            }
+            sequences.push_back(packed.size());
+        }
+        std::vector<float> logProbs;
+        if (!packed.empty()) {
+            logProbs = targetLogProbs(encoder.forwardCausal(packed, state, sequences), targets);
+        }
+
+        std::vector<std::vector<float>> results(continuations.size());
+        for (size_t c = 0; c < continuations.size(); ++c) {
+            if (continuations[c].empty()) {
+                continue;
+            }
+            int first = continuations[c][0];
+            results[c].push_back(first >= 0 ? firstLogProbs[first] : -std::numeric_limits<float>::infinity());
+            results[c].insert(results[c].end(), logProbs.begin() + sequences[c], logProbs.begin() + sequences[c + 1]);
+        }
+        return results;
+    }
+
+    // Cross-encoder relevance of each passage to query, in passage order (higher is more
+    // relevant). Each pair is the sequence [query; passage] with positions running on from the
+    // query into the passage. The query is encoded once and its keys/values stay in each layer's
+    // cache; all passages then go through one packed pass, each attending to the query and to
+    // itself only (block-diagonal), and the pooled rows of each passage go through the
+    // relevance head. The query does not attend to the passages (a prefix-LM mask), which is
+    // what lets its keys/values be shared. A query longer than the maximum sequence length is
+    // cut to leave room for one passage token, and passages to the positions left; an empty
+    // passage scores 0.
+    std::vector<float> rerank(const std::string& query, const std::vector<std::string>& passages,
+                              Pooling pooling = Pooling::Mean) {
+        size_t maxSeqLen = embeddings.getMaxSequenceLength();
+        std::vector<int> queryIds = tokenize(query);
+        queryIds.resize(std::min(queryIds.size(), maxSeqLen - 1));
+
+        Encoder::StreamState state = encoder.createStreamState();
+        if (!queryIds.empty()) {
+            Matrix queryInput(queryIds.size());
+            for (size_t i = 0; i < queryIds.size(); ++i) {
+                queryInput[i] = tokenEmbedding(queryIds[i], i);
+            }
+            encoder.forwardAfterPrefix(queryInput, state);
+        }
+
+        Matrix packed;
+        SequenceOffsets sequences(1, 0);
+        for (const std::string& passage : passages) {
+            std::vector<int> passageIds = tokenize(passage);
+            size_t length = std::min(passageIds.size(), maxSeqLen - queryIds.size());
+            for (size_t i = 0; i < length; ++i) {
+                packed.push_back(tokenEmbedding(passageIds[i], queryIds.size() + i));
+            }
+            sequences.push_back(packed.size());
+        }
+        SequencePooler pooler(pooling, sequences, embeddingDim);
+        if (!packed.empty()) {
+            pooler.addRows(0, encoder.forwardAfterPrefix(packed, state, sequences));
+        }
+        Vector pooled = pooler.result();
+
+        std::vector<float> scores(passages.size());
+        for (size_t p = 0; p < passages.size(); ++p) {
+            Vector pairRow(pooled.begin() + p * embeddingDim, pooled.begin() + (p + 1) * embeddingDim);
+            scores[p] = Utils::matMul(pairRow, relevanceHead)[0];
+        }
+        return scores;
+    }
+
+    int getEmbeddingDim() const {
+        return embeddingDim;
+    }
+
+    ShardedLruCache<Matrix>::Stats getEncoderCacheStats() {
+        return encoderCache.getStats();
+    }
+
+    SingleFlight<Matrix>::Stats getEncoderFlightStats() const {
+        return encoderFlights.getStats();
+    }
+
+    SingleFlight<Vector>::Stats getPooledFlightStats() const {
+        return pooledFlights.getStats();
+    }
+
+    // Answers predictNextWord from the result of a near-duplicate earlier sentence when one is
+    // found, skipping the full encoder pass and the output layer. Sentences are compared by the
+    // cosine similarity of cheap embeddings from the first layerCount encoder layers.
+    void enableSemanticCache(const SemanticCache<std::string>::Params& params, size_t layerCount = 1) {
+        semanticCacheParams = params;
+        probeLayers = std::max<size_t>(layerCount, 1);
+        semanticCache.reset(new SemanticCache<std::string>(embeddingDim, params));
+    }
+
+    SemanticCache<std::string>::Stats getSemanticCacheStats() {
+        return semanticCache ? semanticCache->getStats() : SemanticCache<std::string>::Stats();
+    }
+
+    // Simplified prediction for a given input sequence
+    std::string predictNextWord(const std::string& sentence) {
+        std::vector<int> tokenIds = tokenize(sentence);
+
+        if (tokenIds.empty()) return "";
+
+        if (!semanticCache) {
+            return predictFromTokens(tokenIds);
+        }
+        Vector probe = probeEmbedding(tokenIds);
+        SemanticCache<std::string>::Lookup lookup = semanticCache->lookup(probe);
+        if (lookup.found && !lookup.audit) {
+            return lookup.result;
+        }
+        std::string predicted = predictFromTokens(tokenIds);
+        if (lookup.found) {
+            semanticCache->reportAudit(lookup, predicted);
+        } else {
+            semanticCache->insert(Utils::hashTokens(tokenIds), tokenIds.size(), probe, predicted);
+        }
+        return predicted;
+    }
 };
 
-int main() {
+#if defined(__linux__)
+// Server behind --serve, stopped by SIGINT/SIGTERM
+static InferenceServer* runningServer = nullptr;
+
+static void stopServer(int) {
+    if (runningServer) {
+        runningServer->stop();
+    }
+}
+#endif
+
+int main(int argc, char** argv) {
     // Hyperparameters
     const int EMBEDDING_DIM = 64;
     const int NUM_HEADS = 4;
@@ -103,8 +609,87 @@ int main() {
     const int NUM_LAYERS = 2;
     const int MAX_SEQ_LEN = 100;
 
-    // Create and build transformer
-    Transformer transformer(EMBEDDING_DIM, NUM_HEADS, FFN_HIDDEN_DIM, NUM_LAYERS, MAX_SEQ_LEN);
+    // --bench [seq_len] [embedding_dim] [ffn_hidden_dim]: encoder prefill benchmark.
+    // The defaults give layers whose weights exceed a typical L2.
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        int seqLen = argc > 2 ? std::atoi(argv[2]) : 256;
+        int embedDim = argc > 3 ? std::atoi(argv[3]) : 512;
+        int ffnDim = argc > 4 ? std::atoi(argv[4]) : 2048;
+        Benchmark::encoderPrefill(seqLen, embedDim, NUM_HEADS, ffnDim, NUM_LAYERS);
+        return 0;
+    }
+
+    // --bench-paging [embedding_dim] [ffn_hidden_dim] [steps]: TLB misses with and without huge pages
+    if (argc > 1 && std::string(argv[1]) == "--bench-paging") {
+        int embedDim = argc > 2 ? std::atoi(argv[2]) : 1024;
+        int ffnDim = argc > 3 ? std::atoi(argv[3]) : 4096;
+        int steps = argc > 4 ? std::atoi(argv[4]) : 50;
+        Benchmark::weightPaging(embedDim, NUM_HEADS, ffnDim, NUM_LAYERS, steps);
+        return 0;
+    }
+
+    // --bench-streaming [seq_len] [embedding_dim] [ffn_hidden_dim] [num_layers]: layer streaming from disk
+    if (argc > 1 && std::string(argv[1]) == "--bench-streaming") {
+        int seqLen = argc > 2 ? std::atoi(argv[2]) : 256;
+        int embedDim = argc > 3 ? std::atoi(argv[3]) : 512;
+        int ffnDim = argc > 4 ? std::atoi(argv[4]) : 2048;
+        int numLayers = argc > 5 ? std::atoi(argv[5]) : 6;
+        Benchmark::weightStreaming(seqLen, embedDim, NUM_HEADS, ffnDim, numLayers, "transformer_stream.weights");
+        return 0;
+    }
+
+    // --bench-index [num_vectors] [dim] [k]: HNSW build, search throughput and recall
+    if (argc > 1 && std::string(argv[1]) == "--bench-index") {
+        int numVectors = argc > 2 ? std::atoi(argv[2]) : 20000;
+        int dim = argc > 3 ? std::atoi(argv[3]) : 64;
+        int k = argc > 4 ? std::atoi(argv[4]) : 10;
+        Benchmark::vectorIndex(numVectors, dim, k, "transformer_index.hnsw");
+        return 0;
+    }
+
+    // --bench-queue [producers] [consumers] [items_per_producer]: request handoff, lock-free vs mutex+condvar
+    if (argc > 1 && std::string(argv[1]) == "--bench-queue") {
+        int producers = argc > 2 ? std::atoi(argv[2]) : 4;
+        int consumers = argc > 3 ? std::atoi(argv[3]) : 1;
+        int itemsPerProducer = argc > 4 ? std::atoi(argv[4]) : 1000000;
+        Benchmark::requestQueue(producers, consumers, itemsPerProducer);
+        return 0;
+    }
+
+    // --bench-dispatch [workers] [regions] [gap_us]: parallelFor dispatch overhead per spin limit
+    if (argc > 1 && std::string(argv[1]) == "--bench-dispatch") {
+        int workers = argc > 2 ? std::atoi(argv[2]) : std::max<int>(std::thread::hardware_concurrency(), 2) - 1;
+        int regions = argc > 3 ? std::atoi(argv[3]) : 2000;
+        int gapMicros = argc > 4 ? std::atoi(argv[4]) : 20;
+        Benchmark::poolDispatch(workers, regions, gapMicros);
+        return 0;
+    }
+
+    // --bench-lora [sequences] [seq_len] [adapters] [rank]: mixed-adapter batch (dim 512, ffn 2048) vs
+    // the base model and one pass per adapter
+    if (argc > 1 && std::string(argv[1]) == "--bench-lora") {
+        int numSequences = argc > 2 ? std::atoi(argv[2]) : 32;
+        int seqLen = argc > 3 ? std::atoi(argv[3]) : 32;
+        int numAdapters = argc > 4 ? std::atoi(argv[4]) : 8;
+        int rank = argc > 5 ? std::atoi(argv[5]) : 8;
+        Benchmark::multiLora(std::max(numSequences, 1), std::max(seqLen, 1), 512, NUM_HEADS, 2048, NUM_LAYERS,
+                             std::max(numAdapters, 1), std::max(rank, 1));
+        return 0;
+    }
+
+    // Create and build transformer; TRANSFORMER_ENCODER_CACHE_MB sizes the encoder output cache
+    size_t encoderCacheBytes = size_t(64) << 20;
+    if (const char* env = std::getenv("TRANSFORMER_ENCODER_CACHE_MB")) {
+        encoderCacheBytes = size_t(std::atol(env)) << 20;
+    }
+    Transformer transformer(EMBEDDING_DIM, NUM_HEADS, FFN_HIDDEN_DIM, NUM_LAYERS, MAX_SEQ_LEN, encoderCacheBytes);
+
+    // TRANSFORMER_SEMANTIC_CACHE=<cosine threshold> enables the semantic response cache
+    if (const char* env = std::getenv("TRANSFORMER_SEMANTIC_CACHE")) {
+        SemanticCache<std::string>::Params params;
+        params.threshold = std::atof(env);
+        transformer.enableSemanticCache(params);
+    }
 
     // Example corpus for tokenizer (very small for demonstration)
     std::vector<std::string> corpus = {
@@ -114,6 +699,157 @@ int main() {
     };
     transformer.build(corpus);
 
+    // Warmup buckets: TRANSFORMER_WARMUP_BUCKETS="8,32,100" (empty disables)
+    std::vector<int> warmupBuckets = {8, 32, MAX_SEQ_LEN};
+    if (const char* env = std::getenv("TRANSFORMER_WARMUP_BUCKETS")) {
+        warmupBuckets.clear();
+        std::istringstream buckets(env);
+        std::string bucket;
+        while (std::getline(buckets, bucket, ',')) {
+            warmupBuckets.push_back(std::atoi(bucket.c_str()));
+        }
+    }
+    transformer.warmup(warmupBuckets);
+
+    // --bulk <predict|embed> [input] [output] [tsv|binary]: scores every line of input ("-" or
+    // omitted: stdin/stdout) and writes one record per line in input order. predict records are
+    // the next word (tsv) or its int32 token id, -1 for an empty line (binary); embed records
+    // are the mean-pooled embedding as tab-separated text (tsv) or embeddingDim float32s
+    // (binary). TRANSFORMER_BULK_TOKENIZERS sets the tokenizer threads.
+    if (argc > 2 && std::string(argv[1]) == "--bulk") {
+        std::string mode = argv[2];
+        if (mode != "embed" && mode != "predict") {
+            std::cerr << "Unknown bulk mode \"" << mode << "\" (expected predict or embed)\n";
+            return 1;
+        }
+        bool embedMode = mode == "embed";
+        std::string inputPath = argc > 3 ? argv[3] : "-";
+        std::string outputPath = argc > 4 ? argv[4] : "-";
+        bool binary = argc > 5 && std::string(argv[5]) == "binary";
+        int embeddingDim = transformer.getEmbeddingDim();
+
+        BulkScorer::Options options;
+        options.maxSequenceTokens = MAX_SEQ_LEN;
+        if (const char* env = std::getenv("TRANSFORMER_BULK_TOKENIZERS")) {
+            options.tokenizerThreads = std::max(std::atoi(env), 1);
+        }
+        BulkScorer scorer(
+            [&transformer](const std::string& line) { return transformer.tokenize(line, false); },
+            [&transformer, embedMode, binary, embeddingDim](const std::vector<std::vector<int>>& batch,
+                                                            std::vector<std::string>& records) {
+                if (embedMode) {
+                    Vector pooled = transformer.embedTokens(batch);
+                    for (size_t s = 0; s < batch.size(); ++s) {
+                        const float* row = pooled.data() + s * embeddingDim;
+                        if (binary) {
+                            records.emplace_back(reinterpret_cast<const char*>(row), embeddingDim * sizeof(float));
+                            continue;
+                        }
+                        std::string record;
+                        char number[32];
+                        for (int i = 0; i < embeddingDim; ++i) {
+                            std::snprintf(number, sizeof(number), i + 1 < embeddingDim ? "%g\t" : "%g\n", row[i]);
+                            record += number;
+                        }
+                        records.push_back(std::move(record));
+                    }
+                    return;
+                }
+                // Empty lines have no next word and stay out of the encoder pass
+                std::vector<std::vector<int>> nonEmpty;
+                for (const std::vector<int>& tokenIds : batch) {
+                    if (!tokenIds.empty()) {
+                        nonEmpty.push_back(tokenIds);
+                    }
+                }
+                std::vector<int> predicted = nonEmpty.empty() ? std::vector<int>() : transformer.predictBatch(nonEmpty);
+                size_t next = 0;
+                for (const std::vector<int>& tokenIds : batch) {
+                    int32_t tokenIdx = tokenIds.empty() ? -1 : predicted[next++];
+                    if (binary) {
+                        records.emplace_back(reinterpret_cast<const char*>(&tokenIdx), sizeof(tokenIdx));
+                    } else {
+                        records.push_back((tokenIdx >= 0 ? transformer.decodeToken(tokenIdx) : std::string()) + "\n");
+                    }
+                }
+            },
+            options);
+
+        std::unique_ptr<LineReader> input;
+        try {
+            input.reset(new LineReader(inputPath));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        std::FILE* output = outputPath == "-" ? stdout : std::fopen(outputPath.c_str(), "wb");
+        if (!output) {
+            std::cerr << "Cannot open " << outputPath << "\n";
+            return 1;
+        }
+        static std::vector<char> outputBuffer(size_t(4) << 20); // outlives stdout's last flush at exit
+        std::setvbuf(output, outputBuffer.data(), _IOFBF, outputBuffer.size());
+        BulkScorer::Stats stats;
+        try {
+            stats = scorer.run(*input, output);
+        } catch (const std::exception& e) {
+            if (output != stdout) {
+                std::fclose(output);
+            }
+            std::cerr << "Bulk scoring failed: " << e.what() << "\n";
+            return 1;
+        }
+        if (output != stdout) {
+            std::fclose(output);
+        }
+        std::cerr << "Scored " << stats.lines << " lines (" << stats.tokens << " tokens, " << stats.batches
+                  << " batches) in " << std::fixed << std::setprecision(2) << stats.seconds << " s: "
+                  << std::setprecision(0) << stats.linesPerHour() << " lines/hour\n";
+        return 0;
+    }
+
+    // --serve [socket_path]: generation requests over a Unix domain socket (see InferenceServer),
+    // continuously batched; TRANSFORMER_MAX_BATCH bounds the sequences per step.
+    // TRANSFORMER_LORA_ADAPTERS=<count>[:rank] serves adapters 0..count-1 (rank 8 by default)
+    // next to the base model, mixed freely within a batch.
+    if (argc > 1 && std::string(argv[1]) == "--serve") {
+#if defined(__linux__)
+        std::string socketPath = argc > 2 ? argv[2] : "transformer.sock";
+        size_t maxBatch = 32;
+        if (const char* env = std::getenv("TRANSFORMER_MAX_BATCH")) {
+            maxBatch = std::max(std::atoi(env), 1);
+        }
+        if (const char* env = std::getenv("TRANSFORMER_LORA_ADAPTERS")) {
+            LoraConfig config;
+            if (const char* rank = std::strchr(env, ':')) {
+                config.rank = std::max(std::atoi(rank + 1), 1);
+            }
+            for (int id = 0, count = std::atoi(env); id < count; ++id) {
+                transformer.addAdapter(id, config);
+            }
+        }
+        BatchScheduler scheduler([&transformer](const std::vector<std::vector<int>>& batch,
+                                                const std::vector<int>& adapters) {
+            return transformer.predictBatch(batch, adapters);
+        }, maxBatch);
+        InferenceServer::Codec codec;
+        codec.encode = [&transformer](const std::string& text) { return transformer.tokenize(text); };
+        codec.decode = [&transformer](int tokenIdx) { return transformer.decodeToken(tokenIdx); };
+        codec.hasAdapter = [&transformer](int id) { return transformer.hasAdapter(id); };
+        InferenceServer server(socketPath, scheduler, codec);
+        runningServer = &server;
+        std::signal(SIGINT, stopServer);
+        std::signal(SIGTERM, stopServer);
+        std::cout << "Serving on " << socketPath << "\n";
+        server.run();
+        runningServer = nullptr;
+        return 0;
+#else
+        std::cerr << "--serve needs Linux (epoll)\n";
+        return 1;
+#endif
+    }
+
     std::string sentence;
     std::cout << "Enter a sentence (e.g., \"the quick brown\"): ";
     std::getline(std::cin, sentence);
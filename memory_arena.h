@@ -0,0 +1,247 @@
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Bump allocator over large chunks backed by huge pages, so that weight matrices and
+// KV blocks are covered by a handful of TLB entries instead of one per 4 KB page.
+// Each chunk is mapped with the best backing the host allows: explicit hugetlbfs pages
+// (a 1 GB chunk of 1 GB pages when the host has them, else 2 MB pages), then transparent
+// huge pages via madvise, then normal pages. Every chunk counts its live allocations and
+// goes back to the system when the last of them is released (see release()), so a model
+// that is destroyed or rebuilt returns its weights.
+class HugePageArena {
+public:
+    enum PagePolicy { HugeTlbPages, TransparentHugePages, NormalPages };
+
+    static const size_t HUGE_PAGE_BYTES = size_t(2) << 20;
+    static const size_t GIGANTIC_PAGE_BYTES = size_t(1) << 30;
+
+    struct Stats {
+        size_t hugeTlbBytes = 0;
+        size_t transparentBytes = 0;
+        size_t normalBytes = 0;
+        size_t usedBytes = 0;
+    };
+
+private:
+    struct Chunk {
+        char* base;
+        size_t bytes;
+        size_t used;
+        size_t live;          // allocations not released yet
+        PagePolicy requested; // policy in force when it was mapped
+        PagePolicy backing;   // what the host actually gave
+        bool mapped;          // false when it came from the heap fallback
+    };
+
+    std::vector<Chunk> chunks;
+    std::mutex mutex;
+    size_t chunkBytes;
+    PagePolicy policy;
+    Stats stats;
+
+    static size_t roundUp(size_t value, size_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    size_t& backingBytes(PagePolicy backing) {
+        return backing == HugeTlbPages ? stats.hugeTlbBytes
+             : backing == TransparentHugePages ? stats.transparentBytes : stats.normalBytes;
+    }
+
+    Chunk makeChunk(void* base, size_t bytes, PagePolicy backing, bool mapped) {
+        backingBytes(backing) += bytes;
+        return Chunk{static_cast<char*>(base), bytes, 0, 0, policy, backing, mapped};
+    }
+
+    Chunk mapChunk(size_t bytes) {
+#if defined(__linux__)
+        if (policy == HugeTlbPages) {
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#if defined(MAP_HUGE_SHIFT)
+            // A whole 1 GB page first; mmap fails at once when the host has none reserved
+            size_t gigantic = roundUp(bytes, GIGANTIC_PAGE_BYTES);
+            void* giganticBase = mmap(nullptr, gigantic, PROT_READ | PROT_WRITE, flags | (30 << MAP_HUGE_SHIFT), -1, 0);
+            if (giganticBase != MAP_FAILED) {
+                return makeChunk(giganticBase, gigantic, HugeTlbPages, true);
+            }
+#endif
+            void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (base != MAP_FAILED) {
+                return makeChunk(base, bytes, HugeTlbPages, true);
+            }
+        }
+        void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED) {
+#if defined(MADV_HUGEPAGE)
+            if (policy != NormalPages && madvise(base, bytes, MADV_HUGEPAGE) == 0) {
+                return makeChunk(base, bytes, TransparentHugePages, true);
+            }
+#endif
+            return makeChunk(base, bytes, NormalPages, true);
+        }
+#endif
+        void* heap = std::aligned_alloc(HUGE_PAGE_BYTES, bytes);
+        if (heap == nullptr) {
+            throw std::bad_alloc();
+        }
+        return makeChunk(heap, bytes, NormalPages, false);
+    }
+
+    void unmapChunk(const Chunk& chunk) {
+        backingBytes(chunk.backing) -= chunk.bytes;
+#if defined(__linux__)
+        if (chunk.mapped) {
+            munmap(chunk.base, chunk.bytes);
+            return;
+        }
+#endif
+        std::free(chunk.base);
+    }
+
+public:
+    explicit HugePageArena(size_t chunkSize = size_t(64) << 20, PagePolicy pagePolicy = HugeTlbPages)
+        : chunkBytes(roundUp(chunkSize, HUGE_PAGE_BYTES)), policy(pagePolicy) {
+        if (const char* env = std::getenv("TRANSFORMER_HUGE_PAGES")) {
+            std::string value(env);
+            policy = value == "0" || value == "off" ? NormalPages : value == "thp" ? TransparentHugePages : policy;
+        }
+    }
+
+    // Every allocation must have been released by now
+    ~HugePageArena() {
+        for (const Chunk& chunk : chunks) {
+            unmapChunk(chunk);
+        }
+    }
+
+    HugePageArena(const HugePageArena&) = delete;
+    HugePageArena& operator=(const HugePageArena&) = delete;
+
+    // Carved from the newest chunk mapped under the current policy that has room, else from
+    // a new chunk. Pair with release().
+    void* allocate(size_t bytes, size_t alignment = 64) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Chunk* chunk = nullptr;
+        for (auto it = chunks.rbegin(); it != chunks.rend() && chunk == nullptr; ++it) {
+            if (it->requested == policy && roundUp(it->used, alignment) + bytes <= it->bytes) {
+                chunk = &*it;
+            }
+        }
+        if (chunk == nullptr) {
+            chunks.push_back(mapChunk(std::max(chunkBytes, roundUp(bytes, HUGE_PAGE_BYTES))));
+            chunk = &chunks.back();
+        }
+        size_t offset = roundUp(chunk->used, alignment);
+        chunk->used = offset + bytes;
+        ++chunk->live;
+        stats.usedBytes += bytes;
+        return chunk->base + offset;
+    }
+
+    // Gives back an allocation of bytes at data; its chunk is unmapped once nothing in it is live.
+    // Space inside a chunk is not reused before then (allocations of a model come and go together).
+    void release(void* data, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        char* address = static_cast<char*>(data);
+        for (size_t c = 0; c < chunks.size(); ++c) {
+            Chunk& chunk = chunks[c];
+            if (address >= chunk.base && address < chunk.base + chunk.bytes) {
+                stats.usedBytes -= bytes;
+                if (--chunk.live == 0) {
+                    unmapChunk(chunk);
+                    chunks.erase(chunks.begin() + c);
+                }
+                return;
+            }
+        }
+    }
+
+    // Applies to allocations from now on: they go to chunks mapped under pagePolicy, so chunks
+    // of the other policies keep their free space for when it is set back
+    void setPagePolicy(PagePolicy pagePolicy) {
+        std::lock_guard<std::mutex> lock(mutex);
+        policy = pagePolicy;
+    }
+
+    // Touches every page of every chunk, including the unused tail of the current one,
+    // so later allocations do not take page faults
+    void prefault() {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t PAGE_BYTES = 4096;
+        for (Chunk& chunk : chunks) {
+            volatile char* bytes = chunk.base;
+            for (size_t offset = 0; offset < chunk.bytes; offset += PAGE_BYTES) {
+                if (offset >= chunk.used) {
+                    bytes[offset] = 0;
+                } else {
+                    (void)bytes[offset];
+                }
+            }
+        }
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    // Arena for model weights (see WeightMatrix). Never destroyed, so matrices that outlive
+    // main() can still release into it.
+    static HugePageArena& weights() {
+        static HugePageArena* arena = new HugePageArena();
+        return *arena;
+    }
+
+    // Arena behind KVBlockPool
+    static HugePageArena& kvCache() {
+        static HugePageArena arena(size_t(16) << 20);
+        return arena;
+    }
+};
+
+// Fixed-size blocks carved from the KV arena, recycled through per-size free lists so
+// that caches come and go without touching the system allocator
+class KVBlockPool {
+private:
+    std::mutex mutex;
+    std::map<size_t, std::vector<float*>> freeBlocks; // block floats -> free blocks
+
+public:
+    float* acquire(size_t floats) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<float*>& free = freeBlocks[floats];
+            if (!free.empty()) {
+                float* block = free.back();
+                free.pop_back();
+                return block;
+            }
+        }
+        return static_cast<float*>(HugePageArena::kvCache().allocate(floats * sizeof(float)));
+    }
+
+    void release(float* block, size_t floats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeBlocks[floats].push_back(block);
+    }
+
+    static KVBlockPool& shared() {
+        static KVBlockPool pool;
+        return pool;
+    }
+};
+
+#endif // MEMORY_ARENA_H
@@ -0,0 +1,98 @@
+#ifndef MODEL_LOADER_H
+#define MODEL_LOADER_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// One-shot readiness flag: consumers wait() until a producer calls open()
+class ReadyGate {
+private:
+    std::mutex mutex;
+    std::condition_variable opened;
+    bool isOpen;
+
+public:
+    ReadyGate() : isOpen(false) {}
+
+    void open() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isOpen = true;
+        }
+        opened.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        opened.wait(lock, [this] { return isOpen; });
+    }
+
+    bool ready() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return isOpen;
+    }
+};
+
+// Threads dedicated to model construction, so loading never queues behind (or blocks)
+// inference work on the shared ThreadPool. Jobs run in the order they were added; the
+// destructor finishes every job before joining.
+class ModelLoader {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    bool stopping;
+
+    void loaderLoop() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    explicit ModelLoader(int numThreads = std::max(1u, std::thread::hardware_concurrency())) : stopping(false) {
+        for (int i = 0; i < numThreads; ++i) {
+            threads.emplace_back([this] { loaderLoop(); });
+        }
+    }
+
+    ~ModelLoader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobAvailable.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    ModelLoader(const ModelLoader&) = delete;
+    ModelLoader& operator=(const ModelLoader&) = delete;
+
+    void add(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        jobAvailable.notify_one();
+    }
+};
+
+#endif // MODEL_LOADER_H
@@ -0,0 +1,171 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include "futex.h"
+
+// Bounded lock-free multi-producer multi-consumer queue: a ring of cells, each stamped with the
+// position it holds next, so a producer or consumer claims a position with a single CAS and
+// hands the cell over with a release store (no lock, no shared counter besides the two
+// positions). Consumers can take every ready item at once, up to a limit, with one CAS.
+//
+// The blocking calls sleep on a futex (EventCount) instead of spinning: consumers while the
+// queue is empty, producers while it is full. An idle consumer costs nothing, and while nobody
+// sleeps each push or pop pays a fence and a load for the wakeup check. close() wakes
+// everyone: push then fails, and consumers drain what is left before popBatch returns 0.
+template <typename T>
+class MpmcQueue {
+private:
+    struct Cell {
+        std::atomic<size_t> sequence; // position + 1 when it holds that item, position when free for it
+        T value;
+    };
+
+    static const size_t CACHE_LINE_BYTES = 64;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(CACHE_LINE_BYTES) std::atomic<size_t> enqueuePosition;
+    alignas(CACHE_LINE_BYTES) std::atomic<size_t> dequeuePosition;
+    alignas(CACHE_LINE_BYTES) std::atomic<bool> closed;
+    EventCount notEmpty;
+    EventCount notFull;
+
+    static size_t roundUpToPowerOfTwo(size_t n) {
+        size_t capacity = 2;
+        while (capacity < n) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+
+public:
+    explicit MpmcQueue(size_t minCapacity)
+        : mask(roundUpToPowerOfTwo(minCapacity) - 1), enqueuePosition(0), dequeuePosition(0), closed(false) {
+        cells.reset(new Cell[mask + 1]);
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    // Moves item in unless the queue is full (item is left untouched then)
+    bool tryPush(T&& item) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t lag = intptr_t(sequence) - intptr_t(position);
+            if (lag == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (lag < 0) {
+                return false; // the cell still holds the item from one lap ago
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        notEmpty.notifyAll();
+        return true;
+    }
+
+    // Waits while the queue is full; false (item dropped) once the queue is closed
+    bool push(T item) {
+        while (!closed.load(std::memory_order_acquire)) {
+            if (tryPush(std::move(item))) {
+                return true;
+            }
+            notFull.waitUntil([this] { return closed.load(std::memory_order_acquire) || !full(); });
+        }
+        return false;
+    }
+
+    // Appends up to maxItems ready items to out, oldest first; returns how many
+    size_t tryPopBatch(std::vector<T>& out, size_t maxItems) {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        size_t count;
+        while (true) {
+            count = 0;
+            while (count < maxItems &&
+                   cells[(position + count) & mask].sequence.load(std::memory_order_acquire) == position + count + 1) {
+                ++count;
+            }
+            if (count == 0) {
+                size_t sequence = cells[position & mask].sequence.load(std::memory_order_acquire);
+                if (intptr_t(sequence) - intptr_t(position + 1) < 0) {
+                    return 0; // nothing published at the head
+                }
+                position = dequeuePosition.load(std::memory_order_relaxed); // another consumer took it
+                continue;
+            }
+            if (dequeuePosition.compare_exchange_weak(position, position + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Cell& cell = cells[(position + i) & mask];
+            out.push_back(std::move(cell.value));
+            cell.sequence.store(position + i + mask + 1, std::memory_order_release);
+        }
+        notFull.notifyAll();
+        return count;
+    }
+
+    // Like tryPopBatch, but sleeps while the queue is empty; 0 only once it is closed and drained
+    size_t popBatch(std::vector<T>& out, size_t maxItems) {
+        while (true) {
+            size_t count = tryPopBatch(out, maxItems);
+            if (count > 0 || maxItems == 0) {
+                return count;
+            }
+            if (closed.load(std::memory_order_acquire) && empty()) {
+                return 0;
+            }
+            notEmpty.waitUntil([this] { return closed.load(std::memory_order_acquire) || !empty(); });
+        }
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        notEmpty.notifyAll();
+        notFull.notifyAll();
+    }
+
+    // Snapshots: exact only while no other thread uses the queue. A position that moves under
+    // the check is read again, so a waiter never takes a busy queue for an idle one.
+    bool empty() const {
+        while (true) {
+            size_t position = dequeuePosition.load(std::memory_order_acquire);
+            intptr_t lag = intptr_t(cells[position & mask].sequence.load(std::memory_order_acquire)) - intptr_t(position + 1);
+            if (lag <= 0) {
+                return lag < 0;
+            }
+        }
+    }
+
+    bool full() const {
+        while (true) {
+            size_t position = enqueuePosition.load(std::memory_order_acquire);
+            intptr_t lag = intptr_t(cells[position & mask].sequence.load(std::memory_order_acquire)) - intptr_t(position);
+            if (lag <= 0) {
+                return lag < 0;
+            }
+        }
+    }
+};
+
+#endif // MPMC_QUEUE_H
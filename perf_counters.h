@@ -0,0 +1,124 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdlib>
+#endif
+
+// One hardware event counted over every thread of the process (one perf_event_open
+// descriptor per thread alive at construction, so create it after the thread pool).
+// available() is false when the kernel or the sandbox does not allow perf events;
+// callers should then report the figure as unavailable rather than zero.
+class PerfCounter {
+private:
+    std::vector<int> fds;
+
+public:
+    PerfCounter(uint32_t type, uint64_t config) {
+#if defined(__linux__)
+        DIR* tasks = opendir("/proc/self/task");
+        if (tasks == nullptr) {
+            return;
+        }
+        while (dirent* entry = readdir(tasks)) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            int fd = syscall(SYS_perf_event_open, &attr, std::atoi(entry->d_name), -1, -1, 0);
+            if (fd < 0) {
+                closedir(tasks);
+                close();
+                return;
+            }
+            fds.push_back(fd);
+        }
+        closedir(tasks);
+#else
+        (void)type;
+        (void)config;
+#endif
+    }
+
+    ~PerfCounter() {
+        close();
+    }
+
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
+
+    bool available() const {
+        return !fds.empty();
+    }
+
+    void start() {
+#if defined(__linux__)
+        for (int fd : fds) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Stops counting and returns the total over all threads
+    uint64_t stop() {
+        uint64_t total = 0;
+#if defined(__linux__)
+        for (int fd : fds) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t value = 0;
+            if (read(fd, &value, sizeof(value)) == sizeof(value)) {
+                total += value;
+            }
+        }
+#endif
+        return total;
+    }
+
+    void close() {
+#if defined(__linux__)
+        for (int fd : fds) {
+            ::close(fd);
+        }
+#endif
+        fds.clear();
+    }
+
+    // Last-level cache misses; each one is a cache line fetched from DRAM
+    static PerfCounter lastLevelCacheMisses() {
+#if defined(__linux__)
+        return PerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        return PerfCounter(0, 0);
+#endif
+    }
+
+    // Data TLB load misses (page walks caused by data reads)
+    static PerfCounter dataTlbMisses() {
+#if defined(__linux__)
+        return PerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+        return PerfCounter(0, 0);
+#endif
+    }
+};
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,136 @@
+#ifndef POOLING_H
+#define POOLING_H
+
+#include <vector>
+#include <mutex>
+#include <limits>
+#include <cstdint>
+#include "transformer_types.h"
+
+// How the token rows of a sequence are reduced to one embedding
+enum class Pooling {
+    Mean, // average of every token row
+    Cls,  // the first token's row
+    Max,  // element-wise maximum over the token rows
+    Last  // the last token's row (what next-token prediction reads)
+};
+
+// Reduces the token rows of a packed batch (see SequenceOffsets) to one row per sequence as
+// they are produced, so the last encoder layer hands its rows over a tile at a time instead
+// of keeping a per-token output. Tiles may arrive in any order and from several threads.
+class SequencePooler {
+private:
+    Pooling pooling;
+    SequenceOffsets sequences;
+    int dim;
+    Vector pooled; // [numSequences x dim]
+    std::mutex mutex;
+
+    size_t numSequences() const {
+        return sequences.size() - 1;
+    }
+
+public:
+    SequencePooler(Pooling poolingMode, const SequenceOffsets& sequenceOffsets, int embeddingDim)
+        : pooling(poolingMode), sequences(sequenceOffsets), dim(embeddingDim) {
+        float identity = pooling == Pooling::Max ? -std::numeric_limits<float>::infinity() : 0.0f;
+        pooled.assign(numSequences() * dim, identity);
+    }
+
+    SequencePooler(const SequencePooler&) = delete;
+    SequencePooler& operator=(const SequencePooler&) = delete;
+
+    // rows[i] is the output row of token firstRow + i. Each sequence the tile touches is
+    // reduced locally first, so the lock is taken once per sequence rather than per row.
+    void addRows(size_t firstRow, const Matrix& rows) {
+        size_t lastRow = firstRow + rows.size();
+        size_t s = std::upper_bound(sequences.begin(), sequences.end(), firstRow) - sequences.begin() - 1;
+        Vector partial(dim);
+        for (; s < numSequences() && sequences[s] < lastRow; ++s) {
+            size_t begin = std::max(firstRow, sequences[s]);
+            size_t end = std::min(lastRow, sequences[s + 1]);
+            if (begin >= end || (pooling == Pooling::Cls && begin != sequences[s]) ||
+                (pooling == Pooling::Last && end != sequences[s + 1])) {
+                continue;
+            }
+            float* target = pooled.data() + s * dim;
+            if (pooling == Pooling::Cls || pooling == Pooling::Last) {
+                const Vector& row = rows[(pooling == Pooling::Cls ? begin : end - 1) - firstRow];
+                std::copy(row.begin(), row.end(), target);
+                continue;
+            }
+            partial = rows[begin - firstRow];
+            for (size_t i = begin + 1; i < end; ++i) {
+                if (pooling == Pooling::Max) {
+                    Utils::maxInPlace(partial.data(), rows[i - firstRow].data(), dim);
+                } else {
+                    Utils::addInPlace(partial.data(), rows[i - firstRow].data(), dim);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pooling == Pooling::Max) {
+                Utils::maxInPlace(target, partial.data(), dim);
+            } else {
+                Utils::addInPlace(target, partial.data(), dim);
+            }
+        }
+    }
+
+    // [numSequences x dim], row-major; an empty sequence pools to zeros. Call once every row
+    // has been added.
+    Vector result() {
+        for (size_t s = 0; s < numSequences(); ++s) {
+            size_t length = sequences[s + 1] - sequences[s];
+            float* row = pooled.data() + s * dim;
+            if (length == 0) {
+                std::fill(row, row + dim, 0.0f);
+            } else if (pooling == Pooling::Mean) {
+                Utils::scaleInPlace(row, 1.0f / length, dim);
+            }
+        }
+        return pooled;
+    }
+};
+
+// Row-wise int8 embeddings: row r is approximately scales[r] * values[r * dim .. (r + 1) * dim)
+struct QuantizedEmbeddings {
+    std::vector<int8_t> values;
+    Vector scales;
+    int dim = 0;
+};
+
+namespace Utils {
+
+    // Scales every dim-sized row of embeddings to unit L2 norm (zero rows are left alone)
+    void normalizeRows(Vector& embeddings, int dim) {
+        for (size_t row = 0; row + dim <= embeddings.size(); row += dim) {
+            float* values = embeddings.data() + row;
+            float norm = std::sqrt(dotProduct(values, values, dim));
+            if (norm > 0.0f) {
+                scaleInPlace(values, 1.0f / norm, dim);
+            }
+        }
+    }
+
+    // Symmetric per-row int8 quantization: each row is scaled so its largest magnitude maps to 127
+    QuantizedEmbeddings quantizeRows(const Vector& embeddings, int dim) {
+        QuantizedEmbeddings quantized;
+        quantized.dim = dim;
+        quantized.values.resize(embeddings.size());
+        for (size_t row = 0; row + dim <= embeddings.size(); row += dim) {
+            float largest = 0.0f;
+            for (int i = 0; i < dim; ++i) {
+                largest = std::max(largest, std::fabs(embeddings[row + i]));
+            }
+            float scale = largest > 0.0f ? largest / 127.0f : 1.0f;
+            for (int i = 0; i < dim; ++i) {
+                quantized.values[row + i] = static_cast<int8_t>(std::lround(embeddings[row + i] / scale));
+            }
+            quantized.scales.push_back(scale);
+        }
+        return quantized;
+    }
+
+}
+
+#endif // POOLING_H
@@ -0,0 +1,84 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+// A block of weights, as handed to the prefetcher
+struct MemoryRange {
+    const void* data;
+    size_t bytes;
+};
+
+// Background thread that pulls upcoming weights into the shared cache levels while the
+// current layer computes. Only the most recent request matters: a new request replaces
+// whatever is still pending. Prefetch instructions never fault, so ranges whose owner
+// has gone away in the meantime are harmless.
+class WeightPrefetcher {
+private:
+    static const size_t CACHE_LINE_BYTES = 64;
+
+    std::thread helper;
+    std::mutex mutex;
+    std::condition_variable requested;
+    std::vector<MemoryRange> pending;
+    bool hasRequest;
+    bool stopping;
+
+    void helperLoop() {
+        while (true) {
+            std::vector<MemoryRange> ranges;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                requested.wait(lock, [this] { return stopping || hasRequest; });
+                if (stopping) {
+                    return;
+                }
+                ranges.swap(pending);
+                hasRequest = false;
+            }
+            for (const MemoryRange& range : ranges) {
+                const char* bytes = static_cast<const char*>(range.data);
+                for (size_t offset = 0; offset < range.bytes; offset += CACHE_LINE_BYTES) {
+                    __builtin_prefetch(bytes + offset, 0, 1); // read, low temporal locality: L2/L3
+                }
+            }
+        }
+    }
+
+public:
+    WeightPrefetcher() : hasRequest(false), stopping(false) {
+        helper = std::thread([this] { helperLoop(); });
+    }
+
+    ~WeightPrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        requested.notify_one();
+        helper.join();
+    }
+
+    WeightPrefetcher(const WeightPrefetcher&) = delete;
+    WeightPrefetcher& operator=(const WeightPrefetcher&) = delete;
+
+    void prefetch(std::vector<MemoryRange> ranges) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = std::move(ranges);
+            hasRequest = true;
+        }
+        requested.notify_one();
+    }
+
+    static WeightPrefetcher& shared() {
+        static WeightPrefetcher prefetcher;
+        return prefetcher;
+    }
+};
+
+#endif // PREFETCH_H
@@ -1,7 +1,125 @@
 #ifndef SELF_ATTENTION_H
 #define SELF_ATTENTION_H
 
+#include <cstring>
 #include "transformer_types.h"
+#include "task_graph.h"
+#include "prefetch.h"
+#include "lora.h"
+
+// Key/Value cache for one attention module (all heads).
+// Keys are stored transposed in fixed-size token blocks: each block is a row-major
+// [headDim x BLOCK_TOKENS] slab, so for a given dimension d the keys of consecutive
+// tokens are contiguous. Values stay token-major ([BLOCK_TOKENS x headDim] per block).
+// Blocks come from KVBlockPool (huge-page backed) and go back to it on clear().
+class KVCache {
+public:
+    static const int BLOCK_TOKENS = 16;
+
+private:
+    int numHeads;
+    int headDim;
+    int length;
+    std::vector<std::vector<float*>> keyBlocks;   // [head][block] -> headDim * BLOCK_TOKENS
+    std::vector<std::vector<float*>> valueBlocks; // [head][block] -> BLOCK_TOKENS * headDim
+
+    size_t blockFloats() const {
+        return size_t(headDim) * BLOCK_TOKENS;
+    }
+
+    void releaseBlocksFrom(int firstBlock) {
+        KVBlockPool& pool = KVBlockPool::shared();
+        for (int h = 0; h < numHeads; ++h) {
+            for (size_t b = firstBlock; b < keyBlocks[h].size(); ++b) {
+                pool.release(keyBlocks[h][b], blockFloats());
+                pool.release(valueBlocks[h][b], blockFloats());
+            }
+            keyBlocks[h].resize(std::min<size_t>(firstBlock, keyBlocks[h].size()));
+            valueBlocks[h].resize(std::min<size_t>(firstBlock, valueBlocks[h].size()));
+        }
+    }
+
+public:
+    KVCache(int nHeads, int hDim) : numHeads(nHeads), headDim(hDim), length(0) {
+        keyBlocks.resize(numHeads);
+        valueBlocks.resize(numHeads);
+    }
+
+    KVCache(KVCache&& other)
+        : numHeads(other.numHeads), headDim(other.headDim), length(other.length),
+          keyBlocks(std::move(other.keyBlocks)), valueBlocks(std::move(other.valueBlocks)) {
+        other.keyBlocks.assign(numHeads, {});
+        other.valueBlocks.assign(numHeads, {});
+        other.length = 0;
+    }
+
+    KVCache(const KVCache&) = delete;
+    KVCache& operator=(const KVCache&) = delete;
+
+    ~KVCache() {
+        clear();
+    }
+
+    // Resizes the cache to newLength tokens; new slots are filled with set().
+    // Separate slots can be set concurrently once the cache has been resized.
+    void resize(int newLength) {
+        int blocks = (newLength + BLOCK_TOKENS - 1) / BLOCK_TOKENS;
+        releaseBlocksFrom(blocks);
+        KVBlockPool& pool = KVBlockPool::shared();
+        for (int h = 0; h < numHeads; ++h) {
+            while ((int)keyBlocks[h].size() < blocks) {
+                float* keyBlock = pool.acquire(blockFloats());
+                std::fill(keyBlock, keyBlock + blockFloats(), 0.0f); // padding slots take part in scoring
+                keyBlocks[h].push_back(keyBlock);
+                valueBlocks[h].push_back(pool.acquire(blockFloats()));
+            }
+        }
+        length = newLength;
+    }
+
+    // key, value: [embeddingDim] projections of one token, heads laid out back to back
+    void set(int token, const Vector& key, const Vector& value) {
+        int block = token / BLOCK_TOKENS;
+        int slot = token % BLOCK_TOKENS;
+        for (int h = 0; h < numHeads; ++h) {
+            float* keyBlock = keyBlocks[h][block];
+            for (int d = 0; d < headDim; ++d) {
+                keyBlock[d * BLOCK_TOKENS + slot] = key[h * headDim + d];
+            }
+            std::copy(value.begin() + h * headDim, value.begin() + (h + 1) * headDim,
+                      valueBlocks[h][block] + slot * headDim);
+        }
+    }
+
+    void append(const Vector& key, const Vector& value) {
+        resize(length + 1);
+        set(length - 1, key, value);
+    }
+
+    // Returns every block to the pool
+    void clear() {
+        releaseBlocksFrom(0);
+        length = 0;
+    }
+
+    int size() const {
+        return length;
+    }
+
+    int numBlocks() const {
+        return (length + BLOCK_TOKENS - 1) / BLOCK_TOKENS;
+    }
+
+    // [headDim x BLOCK_TOKENS] transposed keys of tokens [block * BLOCK_TOKENS, ...)
+    const float* keyBlock(int head, int block) const {
+        return keyBlocks[head][block];
+    }
+
+    // [headDim] value of one token
+    const float* value(int head, int token) const {
+        return valueBlocks[head][token / BLOCK_TOKENS] + (token % BLOCK_TOKENS) * headDim;
+    }
+};
 
 class MultiHeadSelfAttention {
 private:
@@ -9,105 +127,320 @@ private:
     int numHeads;
     int headDim;
 
-    Matrix W_Q, W_K, W_V, W_O; // Weight matrices for Query, Key, Value, and Output
+    WeightMatrix W_Q, W_K, W_V, W_O; // Weight matrices for Query, Key, Value, and Output
+    LoraDeltas loraQ, loraK, loraV, loraO; // Adapter deltas of each, added after the base product
 
     // Helper function for scaled dot-product attention
-    // Q, K, V are for a single head, and are matrices (seq_len x head_dim)
-    Matrix scaledDotProductAttention(const Matrix& Q, const Matrix& K, const Matrix& V, bool mask = false) {
-        // (Q * K^T) / sqrt(head_dim)
-        Matrix scores(Q.size(), Vector(K.size()));
+    // Q is for a single head (num_queries x head_dim); keys and values are tokens [0, prefixEnd)
+    // of the cache followed by tokens [keyBegin, keyEnd) (prefixEnd <= keyBegin). Query i sits
+    // at absolute position queryOffset + i, which is what the causal mask uses.
+    Matrix scaledDotProductAttention(const Matrix& Q, const KVCache& cache, int head, int queryOffset, bool mask,
+                                     int prefixEnd, int keyBegin, int keyEnd) {
+        const int B = KVCache::BLOCK_TOKENS;
+        int prefixBlocks = (prefixEnd + B - 1) / B;
+        int firstBlock = keyBegin / B;
+        int lastBlock = (keyEnd + B - 1) / B;
+        int rangeKeys = keyEnd - keyBegin;
+        int numKeys = prefixEnd + rangeKeys;
+        float scale = 1.0f / std::sqrt(headDim);
+
+        // One query row at a time through the calling thread's score scratch; whole blocks are
+        // scored (the prefix's, then the range's) and the range's scores are then moved down
+        // to follow the prefix's, so keyScores[k] is the score of the k-th key
+        Vector& scores = scoreScratch();
+        scores.resize((prefixBlocks + lastBlock - firstBlock) * B);
+        float* keyScores = scores.data();
+        float* rangeScores = scores.data() + prefixBlocks * B;
+        Matrix output(Q.size(), Vector(headDim, 0.0f));
         for (size_t i = 0; i < Q.size(); ++i) {
-            for (size_t j = 0; j < K.size(); ++j) {
-                scores[i][j] = Utils::dotProduct(Q[i], K[j]) / std::sqrt(headDim);
+            // (Q * K^T) / sqrt(head_dim), accumulated as an outer product over each key block:
+            // for every dimension d, q[d] is multiplied into B contiguous keys at once.
+            std::fill(scores.begin(), scores.end(), 0.0f);
+            for (int b = 0; b < prefixBlocks; ++b) {
+                const float* keyBlock = cache.keyBlock(head, b);
+                for (int d = 0; d < headDim; ++d) {
+                    Utils::axpy(scores.data() + b * B, Q[i][d], keyBlock + d * B, B);
+                }
             }
-        }
+            for (int b = firstBlock; b < lastBlock; ++b) {
+                const float* keyBlock = cache.keyBlock(head, b);
+                for (int d = 0; d < headDim; ++d) {
+                    Utils::axpy(rangeScores + (b - firstBlock) * B, Q[i][d], keyBlock + d * B, B);
+                }
+            }
+            std::memmove(keyScores + prefixEnd, rangeScores + (keyBegin - firstBlock * B), rangeKeys * sizeof(float));
+            Utils::scaleInPlace(keyScores, scale, numKeys);
 
-        // Apply masking for decoder self-attention
-        if (mask) {
-            for (size_t i = 0; i < scores.size(); ++i) {
-                for (size_t j = i + 1; j < scores[i].size(); ++j) {
-                    scores[i][j] = -1e9; // Set to a very small number for masking
+            // Apply masking for decoder self-attention
+            if (mask) {
+                int firstMasked = queryOffset + i + 1;
+                for (int j = std::max(0, firstMasked); j < prefixEnd; ++j) {
+                    keyScores[j] = -1e9; // Set to a very small number for masking
+                }
+                for (int j = std::max(keyBegin, firstMasked); j < keyEnd; ++j) {
+                    keyScores[prefixEnd + j - keyBegin] = -1e9;
                 }
             }
-        }
 
-        // Apply softmax to scores
-        Matrix attentionWeights(scores.size(), Vector(scores[0].size()));
-        for (size_t i = 0; i < scores.size(); ++i) {
-            attentionWeights[i] = Utils::softmax(scores[i]);
-        }
+            // Apply softmax to scores (in place: scores become the attention weights)
+            Utils::softmaxInPlace(keyScores, numKeys);
 
-        // attentionWeights * V
-        Matrix output(attentionWeights.size(), Vector(V[0].size(), 0.0f));
-        for (size_t i = 0; i < attentionWeights.size(); ++i) { // For each query token
-            for (size_t k = 0; k < V[0].size(); ++k) { // For each dimension in V
-                for (size_t j = 0; j < attentionWeights[0].size(); ++j) { // For each key token
-                    output[i][k] += attentionWeights[i][j] * V[j][k];
-                }
+            // attentionWeights * V
+            for (int j = 0; j < prefixEnd; ++j) { // For each key token
+                Utils::axpy(output[i].data(), keyScores[j], cache.value(head, j), headDim);
+            }
+            for (int j = keyBegin; j < keyEnd; ++j) {
+                Utils::axpy(output[i].data(), keyScores[prefixEnd + j - keyBegin], cache.value(head, j), headDim);
             }
         }
         return output;
     }
 
+    // Per-thread score row used by scaledDotProductAttention
+    static Vector& scoreScratch() {
+        thread_local Vector scratch;
+        return scratch;
+    }
+
+    // Attention for head h of query rows [begin, end) over cache tokens [0, prefixEnd) and
+    // [keyBegin, keyEnd); row begin sits at absolute position queryOffset. Writes the head's
+    // columns of concatenatedHeads.
+    void attendRows(int h, const Matrix& queries, size_t begin, size_t end, const KVCache& cache, int queryOffset,
+                    bool mask, int prefixEnd, int keyBegin, int keyEnd, Matrix& concatenatedHeads) {
+        Matrix Q_head(end - begin, Vector(headDim));
+        for (size_t i = begin; i < end; ++i) {
+            std::copy(queries[i].begin() + h * headDim, queries[i].begin() + (h + 1) * headDim,
+                      Q_head[i - begin].begin());
+        }
+
+        Matrix headOutput = scaledDotProductAttention(Q_head, cache, h, queryOffset, mask, prefixEnd, keyBegin, keyEnd);
+
+        // Concatenate heads
+        for (size_t i = begin; i < end; ++i) {
+            std::copy(headOutput[i - begin].begin(), headOutput[i - begin].end(),
+                      concatenatedHeads[i].begin() + h * headDim);
+        }
+    }
+
+    // Attention for head h: reads the head's columns of queries, writes them in concatenatedHeads.
+    // Without sequences every query attends over the whole cache. With sequences the queries are
+    // a packed batch whose keys sit at cache positions queryOffset onwards, and each sequence
+    // attends only to its own keys (a block-diagonal mask that skips the other blocks entirely)
+    // plus the tokens the cache already held, a prefix shared by every sequence.
+    void attendHead(int h, const Matrix& queries, const KVCache& cache, int queryOffset, bool mask,
+                    const SequenceOffsets& sequences, Matrix& concatenatedHeads) {
+        if (sequences.empty()) {
+            attendRows(h, queries, 0, queries.size(), cache, queryOffset, mask, 0, 0, cache.size(), concatenatedHeads);
+            return;
+        }
+        for (size_t s = 0; s + 1 < sequences.size(); ++s) {
+            int first = queryOffset + sequences[s];
+            int last = queryOffset + sequences[s + 1];
+            attendRows(h, queries, sequences[s], sequences[s + 1], cache, first, mask, queryOffset, first, last,
+                       concatenatedHeads);
+        }
+    }
+
 public:
-    MultiHeadSelfAttention(int embedDim, int nHeads) 
+    // With initializeWeights false only the shapes are set; weights are filled in later
+    // with initializeWeights(key) or attached with bindWeights() (e.g. from a weight file)
+    MultiHeadSelfAttention(int embedDim, int nHeads, bool initializeWeights = true)
         : embeddingDim(embedDim), numHeads(nHeads), headDim(embedDim / nHeads) {
-        
-        // Initialize weight matrices
-        Utils::initializeMatrix(W_Q, embeddingDim, embeddingDim);
-        Utils::initializeMatrix(W_K, embeddingDim, embeddingDim);
-        Utils::initializeMatrix(W_V, embeddingDim, embeddingDim);
-        Utils::initializeMatrix(W_O, embeddingDim, embeddingDim);
+        for (WeightMatrix* W : {&W_Q, &W_K, &W_V, &W_O}) {
+            W->setShape(embeddingDim, embeddingDim);
+        }
+        for (LoraDeltas* lora : {&loraQ, &loraK, &loraV, &loraO}) {
+            lora->setShape(embeddingDim, embeddingDim);
+        }
+        if (initializeWeights) {
+            this->initializeWeights(Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "attention"));
+        }
+    }
+
+    // Initialize weight matrices; the values depend only on key
+    void initializeWeights(uint64_t key) {
+        int index = 0;
+        for (WeightMatrix* W : {&W_Q, &W_K, &W_V, &W_O}) {
+            Utils::initializeMatrix(*W, embeddingDim, embeddingDim, Utils::childKey(key, index++));
+        }
+    }
+
+    // Attaches adapter id to the projections config.targets names; the factors depend only on key
+    void addAdapter(int id, const LoraConfig& config, uint64_t key) {
+        const LoraTarget targets[] = {LORA_QUERY, LORA_KEY, LORA_VALUE, LORA_OUTPUT};
+        LoraDeltas* deltas[] = {&loraQ, &loraK, &loraV, &loraO};
+        for (int index = 0; index < 4; ++index) {
+            if (config.targets & targets[index]) {
+                deltas[index]->initialize(id, config, Utils::childKey(key, index));
+            }
+        }
+    }
+
+    void removeAdapter(int id) {
+        for (LoraDeltas* lora : {&loraQ, &loraK, &loraV, &loraO}) {
+            lora->remove(id);
+        }
+    }
+
+    // Points the weights at a block laid out in collectWeights() order; returns the end
+    const char* bindWeights(const char* cursor) {
+        for (WeightMatrix* W : {&W_Q, &W_K, &W_V, &W_O}) {
+            cursor = W->bind(cursor);
+        }
+        return cursor;
+    }
+
+    // Drops the weights (e.g. once a streamed block is unmapped); the shapes stay
+    void unbindWeights() {
+        for (WeightMatrix* W : {&W_Q, &W_K, &W_V, &W_O}) {
+            W->unbind();
+        }
+    }
+
+    void collectWeights(std::vector<MemoryRange>& ranges) const {
+        ranges.push_back(MemoryRange{W_Q.data(), W_Q.bytes()});
+        ranges.push_back(MemoryRange{W_K.data(), W_K.bytes()});
+        ranges.push_back(MemoryRange{W_V.data(), W_V.bytes()});
+        ranges.push_back(MemoryRange{W_O.data(), W_O.bytes()});
+    }
+
+    // Sizes the calling thread's scratch for sequences of up to maxKeys tokens, so the first
+    // request of that length does not allocate (the shared prefix and the key range may each
+    // straddle an extra block)
+    static void reserveScratch(size_t maxKeys) {
+        scoreScratch().reserve(maxKeys + 3 * KVCache::BLOCK_TOKENS);
+    }
+
+    KVCache createCache() const {
+        return KVCache(numHeads, headDim);
     }
 
     // input: [seq_len, embeddingDim]
     Matrix forward(const Matrix& input, bool mask = false) {
-        int seqLen = input.size();
+        KVCache cache = createCache();
+        return forward(input, cache, mask);
+    }
 
-        // Linear transformations for Q, K, V for all tokens in the sequence
-        Matrix Q_all(seqLen, Vector(embeddingDim));
-        Matrix K_all(seqLen, Vector(embeddingDim));
-        Matrix V_all(seqLen, Vector(embeddingDim));
+    // Incremental form: the keys/values of input are appended to cache and the queries
+    // attend over everything the cache holds (earlier tokens included).
+    Matrix forward(const Matrix& input, KVCache& cache, bool mask = false) {
+        Matrix output;
+        AttentionBuffers buffers;
+        TaskGraph graph;
+        addToGraph(graph, input, {}, ThreadPool::grainForRowWidth(embeddingDim * embeddingDim),
+                   cache, mask, {}, {}, buffers, output);
+        graph.run(ThreadPool::shared());
+        return output;
+    }
 
-        for (int i = 0; i < seqLen; ++i) {
-            Q_all[i] = Utils::matMul(input[i], W_Q);
-            K_all[i] = Utils::matMul(input[i], W_K);
-            V_all[i] = Utils::matMul(input[i], W_V);
-        }
+    // Same result as forward(input, mask), with every projection run weight-stationary
+    // over the whole batch (see Utils::matMulWeightStationary). sequences and adapters as in
+    // addToGraph.
+    Matrix forwardWeightStationary(const Matrix& input, bool mask = false, const SequenceOffsets& sequences = {},
+                                   const RowAdapters& adapters = {}) {
+        ThreadPool& pool = ThreadPool::shared();
+        size_t seqLen = input.size();
 
-        // Split into multiple heads and compute attention
-        Matrix concatenatedHeads(seqLen, Vector(embeddingDim));
+        Matrix Q_all = Utils::matMulWeightStationary(input, W_Q);
+        Matrix K_all = Utils::matMulWeightStationary(input, W_K);
+        Matrix V_all = Utils::matMulWeightStationary(input, W_V);
+        loraQ.addDeltaRows(input, adapters, Q_all);
+        loraK.addDeltaRows(input, adapters, K_all);
+        loraV.addDeltaRows(input, adapters, V_all);
 
-        for (int h = 0; h < numHeads; ++h) {
-            Matrix Q_head(seqLen, Vector(headDim));
-            Matrix K_head(seqLen, Vector(headDim));
-            Matrix V_head(seqLen, Vector(headDim));
+        KVCache cache = createCache();
+        cache.resize(seqLen);
+        pool.parallelFor(0, seqLen, ThreadPool::grainForRowWidth(embeddingDim), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                cache.set(i, K_all[i], V_all[i]);
+            }
+        });
 
-            for (int i = 0; i < seqLen; ++i) {
-                for (int d = 0; d < headDim; ++d) {
-                    Q_head[i][d] = Q_all[i][h * headDim + d];
-                    K_head[i][d] = K_all[i][h * headDim + d];
-                    V_head[i][d] = V_all[i][h * headDim + d];
-                }
+        Matrix concatenatedHeads(seqLen, Vector(embeddingDim));
+        pool.parallelFor(0, numHeads, 1, [&](size_t begin, size_t end) {
+            for (size_t h = begin; h < end; ++h) {
+                attendHead(h, Q_all, cache, 0, mask, sequences, concatenatedHeads);
             }
+        });
 
-            Matrix headOutput = scaledDotProductAttention(Q_head, K_head, V_head, mask);
+        Matrix output = Utils::matMulWeightStationary(concatenatedHeads, W_O);
+        loraO.addDeltaRows(concatenatedHeads, adapters, output);
+        return output;
+    }
 
-            // Concatenate heads
-            for (int i = 0; i < seqLen; ++i) {
-                for (int d = 0; d < headDim; ++d) {
-                    concatenatedHeads[i][h * headDim + d] = headOutput[i][d];
-                }
+    // Intermediate results of one attention pass; must outlive the graph run
+    struct AttentionBuffers {
+        Matrix queries;           // [seq_len, embeddingDim]
+        Matrix concatenatedHeads; // [seq_len, embeddingDim]
+        RowAdapters adapters;     // adapter id of each row, or empty
+    };
+
+    // Adds this attention pass to graph as three stages:
+    //   Q/K/V projection per token tile -> one node per head -> output projection per tile.
+    // inputTiles[t] is the node producing rows [t * grain, (t + 1) * grain) of input (empty
+    // when input is already available). Keys/values are appended to cache, which is resized
+    // here, at graph build time. A non-empty sequences marks input as a packed batch whose
+    // sequences do not attend to each other (see attendHead). A non-empty adapters gives the
+    // adapter id of each row: every projection adds the deltas of the rows' adapters to the
+    // shared base product, a few grouped low-rank products per tile. Returns the node producing
+    // each output tile.
+    std::vector<TaskGraph::TaskId> addToGraph(TaskGraph& graph, const Matrix& input,
+                                              const std::vector<TaskGraph::TaskId>& inputTiles, size_t grain,
+                                              KVCache& cache, bool mask, const SequenceOffsets& sequences,
+                                              const RowAdapters& adapters, AttentionBuffers& buffers, Matrix& output) {
+        size_t seqLen = input.size();
+        int queryOffset = cache.size();
+        cache.resize(queryOffset + seqLen);
+        buffers.queries.assign(seqLen, Vector());
+        buffers.concatenatedHeads.assign(seqLen, Vector(embeddingDim));
+        buffers.adapters = adapters;
+        output.assign(seqLen, Vector());
+
+        // Linear transformations for Q, K, V; K and V go straight into the cache,
+        // with K transposed into key blocks
+        std::vector<TaskGraph::TaskId> projections;
+        for (size_t begin = 0, t = 0; begin < seqLen; begin += grain, ++t) {
+            size_t end = std::min(seqLen, begin + grain);
+            std::vector<TaskGraph::TaskId> dependencies;
+            if (!inputTiles.empty()) {
+                dependencies.push_back(inputTiles[t]);
             }
+            projections.push_back(graph.add([this, &input, &cache, &buffers, begin, end, queryOffset] {
+                Matrix keys(end - begin), values(end - begin);
+                for (size_t i = begin; i < end; ++i) {
+                    buffers.queries[i] = Utils::matMul(input[i], W_Q);
+                    keys[i - begin] = Utils::matMul(input[i], W_K);
+                    values[i - begin] = Utils::matMul(input[i], W_V);
+                }
+                loraQ.addDelta(input, buffers.adapters, begin, end, buffers.queries.data() + begin);
+                loraK.addDelta(input, buffers.adapters, begin, end, keys.data());
+                loraV.addDelta(input, buffers.adapters, begin, end, values.data());
+                for (size_t i = begin; i < end; ++i) {
+                    cache.set(queryOffset + i, keys[i - begin], values[i - begin]);
+                }
+            }, dependencies));
         }
 
-        // Final linear layer
-        Matrix output(seqLen, Vector(embeddingDim));
-        for (int i = 0; i < seqLen; ++i) {
-            output[i] = Utils::matMul(concatenatedHeads[i], W_O);
+        // Split into multiple heads and compute attention; each head writes its own columns
+        std::vector<TaskGraph::TaskId> heads;
+        for (int h = 0; h < numHeads; ++h) {
+            heads.push_back(graph.add([this, h, &cache, &buffers, queryOffset, mask, sequences] {
+                attendHead(h, buffers.queries, cache, queryOffset, mask, sequences, buffers.concatenatedHeads);
+            }, projections));
         }
 
-        return output;
+        // Final linear layer
+        std::vector<TaskGraph::TaskId> outputTiles;
+        for (size_t begin = 0; begin < seqLen; begin += grain) {
+            size_t end = std::min(seqLen, begin + grain);
+            outputTiles.push_back(graph.add([this, &buffers, &output, begin, end] {
+                for (size_t i = begin; i < end; ++i) {
+                    output[i] = Utils::matMul(buffers.concatenatedHeads[i], W_O);
+                }
+                loraO.addDelta(buffers.concatenatedHeads, buffers.adapters, begin, end, output.data() + begin);
+            }, heads));
+        }
+        return outputTiles;
     }
 };
 
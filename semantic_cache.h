@@ -0,0 +1,222 @@
+#ifndef SEMANTIC_CACHE_H
+#define SEMANTIC_CACHE_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include "transformer_types.h"
+#include "hnsw_index.h"
+
+// Maps sentence embeddings (L2-normalized, e.g. from a shallow pooled encoder pass) to results,
+// answering a lookup with the result of the most similar stored sentence when their cosine
+// similarity reaches a threshold. Neighbours come from a small HnswIndex; evicted entries stay
+// in the graph as tombstones until they make up half of it, when the index is rebuilt from
+// the live entries.
+//
+// Admission: a sentence is only stored once it has missed admitAfterMisses times (so one-off
+// requests do not churn the cache) and has at least minTokens tokens (short inputs are cheap
+// to recompute). Eviction: the least recently or least frequently used live entry goes first.
+// Audit: every auditInterval-th hit is flagged for the caller to recompute; reportAudit()
+// counts the hits whose cached result turned out different (false hits) and drops that entry.
+template <typename Result>
+class SemanticCache {
+public:
+    enum class Eviction { LeastRecentlyUsed, LeastFrequentlyUsed };
+
+    struct Params {
+        float threshold = 0.95f;      // minimum cosine similarity for a hit
+        size_t capacity = 1024;       // live entries
+        int admitAfterMisses = 2;
+        size_t minTokens = 1;
+        Eviction eviction = Eviction::LeastRecentlyUsed;
+        uint64_t auditInterval = 100; // 0 disables auditing
+    };
+
+    struct Stats {
+        uint64_t lookups = 0;
+        uint64_t hits = 0;
+        uint64_t insertions = 0;
+        uint64_t rejected = 0; // not admitted
+        uint64_t evictions = 0;
+        uint64_t audits = 0;
+        uint64_t falseHits = 0;
+        size_t entries = 0;
+
+        double hitRate() const {
+            return lookups > 0 ? double(hits) / lookups : 0.0;
+        }
+
+        // Share of audited hits whose cached result was wrong
+        double falseHitRate() const {
+            return audits > 0 ? double(falseHits) / audits : 0.0;
+        }
+    };
+
+    struct Lookup {
+        bool found = false;
+        bool audit = false;     // recompute the result and pass it to reportAudit()
+        float similarity = 0.0f;
+        uint64_t entry = 0;     // id of the entry hit (stable across compactions)
+        Result result;
+    };
+
+private:
+    static const size_t NEIGHBORS = 8; // nearest entries inspected per lookup
+
+    struct Entry {
+        uint64_t id; // from nextEntryId; entries stay in increasing id order
+        bool live;
+        Result result;
+        uint64_t lastUsed;
+        uint64_t uses;
+    };
+
+    Params params;
+    int dim;
+    std::mutex mutex;
+    std::unique_ptr<HnswIndex> index;  // node i is entries[i]
+    std::vector<Entry> entries;
+    Vector embeddings;                 // entries.size() x dim, kept for rebuilds
+    size_t liveEntries;
+    uint64_t clock;
+    uint64_t nextEntryId;
+    std::unordered_map<uint64_t, int> missCounts; // token hash -> misses, for admission
+    Stats stats;
+
+    static HnswIndex::Params indexParams() {
+        HnswIndex::Params indexParams;
+        indexParams.M = 8;
+        indexParams.efConstruction = 64;
+        indexParams.efSearch = 32;
+        indexParams.metric = HnswIndex::Metric::InnerProduct;
+        return indexParams;
+    }
+
+    void evictOne() {
+        size_t victim = entries.size();
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (!entries[i].live) {
+                continue;
+            }
+            bool older = victim == entries.size() ||
+                         (params.eviction == Eviction::LeastRecentlyUsed
+                              ? entries[i].lastUsed < entries[victim].lastUsed
+                              : entries[i].uses < entries[victim].uses ||
+                                    (entries[i].uses == entries[victim].uses && entries[i].lastUsed < entries[victim].lastUsed));
+            if (older) {
+                victim = i;
+            }
+        }
+        if (victim < entries.size()) {
+            entries[victim].live = false;
+            --liveEntries;
+            ++stats.evictions;
+        }
+    }
+
+    // Rebuilds the index from the live entries only
+    void compact() {
+        std::vector<Entry> liveList;
+        Vector liveEmbeddings;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].live) {
+                liveList.push_back(std::move(entries[i]));
+                liveEmbeddings.insert(liveEmbeddings.end(), embeddings.begin() + i * dim, embeddings.begin() + (i + 1) * dim);
+            }
+        }
+        entries.swap(liveList);
+        embeddings.swap(liveEmbeddings);
+        index.reset(new HnswIndex(dim, indexParams()));
+        index->add(embeddings);
+    }
+
+public:
+    SemanticCache(int embeddingDim, const Params& cacheParams)
+        : params(cacheParams), dim(embeddingDim), index(new HnswIndex(embeddingDim, indexParams())),
+          liveEntries(0), clock(0), nextEntryId(0) {}
+
+    SemanticCache(const SemanticCache&) = delete;
+    SemanticCache& operator=(const SemanticCache&) = delete;
+
+    // embedding: [dim], L2-normalized
+    Lookup lookup(const Vector& embedding) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.lookups;
+        Lookup lookup;
+        for (const HnswIndex::Neighbor& neighbor : index->search(embedding.data(), NEIGHBORS)) {
+            float similarity = 1.0f - neighbor.distance;
+            if (similarity < params.threshold) {
+                break;
+            }
+            Entry& entry = entries[neighbor.id];
+            if (!entry.live) {
+                continue;
+            }
+            entry.lastUsed = ++clock;
+            ++entry.uses;
+            ++stats.hits;
+            lookup.found = true;
+            lookup.similarity = similarity;
+            lookup.entry = entry.id;
+            lookup.result = entry.result;
+            lookup.audit = params.auditInterval > 0 && stats.hits % params.auditInterval == 0;
+            break;
+        }
+        return lookup;
+    }
+
+    // Offers the result computed after a miss; stored only if the admission policy allows.
+    // tokenHash identifies the sentence for admission counting (see Utils::hashTokens).
+    void insert(uint64_t tokenHash, size_t numTokens, const Vector& embedding, const Result& result) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (missCounts.size() > 8 * params.capacity) {
+            missCounts.clear(); // bounded memory: forget old miss counts wholesale
+        }
+        if (params.capacity == 0 || numTokens < params.minTokens || ++missCounts[tokenHash] < params.admitAfterMisses) {
+            ++stats.rejected;
+            return;
+        }
+        missCounts.erase(tokenHash);
+        if (liveEntries >= params.capacity) {
+            evictOne();
+        }
+        entries.push_back(Entry{nextEntryId++, true, result, ++clock, 1});
+        embeddings.insert(embeddings.end(), embedding.begin(), embedding.end());
+        ++liveEntries;
+        ++stats.insertions;
+        if (entries.size() >= 2 * liveEntries && entries.size() > 16) {
+            compact();
+        } else {
+            index->add(embedding);
+        }
+    }
+
+    // Result of recomputing an audited hit; a mismatch counts as a false hit and drops the entry
+    void reportAudit(const Lookup& lookup, const Result& actual) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.audits;
+        if (actual == lookup.result) {
+            return;
+        }
+        ++stats.falseHits;
+        // Found by id: a compaction since the lookup renumbers positions, not ids
+        auto found = std::lower_bound(entries.begin(), entries.end(), lookup.entry,
+                                      [](const Entry& entry, uint64_t id) { return entry.id < id; });
+        if (found != entries.end() && found->id == lookup.entry && found->live) {
+            found->live = false;
+            --liveEntries;
+        }
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats current = stats;
+        current.entries = liveEntries;
+        return current;
+    }
+};
+
+#endif // SEMANTIC_CACHE_H
@@ -0,0 +1,154 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// Small width-generic SIMD wrapper. The widest instruction set enabled at compile
+// time is picked (AVX-512, AVX/AVX2 (+FMA), SSE, otherwise scalar); kernels are
+// written once against Simd::Reg and Simd::WIDTH and handle the tail themselves.
+namespace Simd {
+
+#if defined(__AVX512F__)
+
+    typedef __m512 Reg;
+    const size_t WIDTH = 16;
+
+    inline Reg zero() { return _mm512_setzero_ps(); }
+    inline Reg set1(float x) { return _mm512_set1_ps(x); }
+    inline Reg load(const float* p) { return _mm512_loadu_ps(p); }
+    inline void store(float* p, Reg a) { _mm512_storeu_ps(p, a); }
+    inline Reg add(Reg a, Reg b) { return _mm512_add_ps(a, b); }
+    inline Reg sub(Reg a, Reg b) { return _mm512_sub_ps(a, b); }
+    inline Reg mul(Reg a, Reg b) { return _mm512_mul_ps(a, b); }
+    inline Reg max(Reg a, Reg b) { return _mm512_max_ps(a, b); }
+    inline Reg fma(Reg a, Reg b, Reg c) { return _mm512_fmadd_ps(a, b, c); } // a * b + c
+
+    // Fold 512 -> 128 bits with lane shuffles, then finish within the low lane.
+    inline float reduceAdd(Reg a) {
+        Reg t = _mm512_add_ps(a, _mm512_shuffle_f32x4(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        t = _mm512_add_ps(t, _mm512_shuffle_f32x4(t, t, _MM_SHUFFLE(2, 3, 0, 1)));
+        __m128 s = _mm512_castps512_ps128(t);
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+    inline float reduceMax(Reg a) {
+        Reg t = _mm512_max_ps(a, _mm512_shuffle_f32x4(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        t = _mm512_max_ps(t, _mm512_shuffle_f32x4(t, t, _MM_SHUFFLE(2, 3, 0, 1)));
+        __m128 m = _mm512_castps512_ps128(t);
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+        return _mm_cvtss_f32(m);
+    }
+
+#elif defined(__AVX__)
+
+    typedef __m256 Reg;
+    const size_t WIDTH = 8;
+
+    inline Reg zero() { return _mm256_setzero_ps(); }
+    inline Reg set1(float x) { return _mm256_set1_ps(x); }
+    inline Reg load(const float* p) { return _mm256_loadu_ps(p); }
+    inline void store(float* p, Reg a) { _mm256_storeu_ps(p, a); }
+    inline Reg add(Reg a, Reg b) { return _mm256_add_ps(a, b); }
+    inline Reg sub(Reg a, Reg b) { return _mm256_sub_ps(a, b); }
+    inline Reg mul(Reg a, Reg b) { return _mm256_mul_ps(a, b); }
+    inline Reg max(Reg a, Reg b) { return _mm256_max_ps(a, b); }
+#if defined(__FMA__)
+    inline Reg fma(Reg a, Reg b, Reg c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+    inline Reg fma(Reg a, Reg b, Reg c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+    inline float reduceAdd(Reg a) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+    inline float reduceMax(Reg a) {
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+        return _mm_cvtss_f32(m);
+    }
+
+#elif defined(__SSE__)
+
+    typedef __m128 Reg;
+    const size_t WIDTH = 4;
+
+    inline Reg zero() { return _mm_setzero_ps(); }
+    inline Reg set1(float x) { return _mm_set1_ps(x); }
+    inline Reg load(const float* p) { return _mm_loadu_ps(p); }
+    inline void store(float* p, Reg a) { _mm_storeu_ps(p, a); }
+    inline Reg add(Reg a, Reg b) { return _mm_add_ps(a, b); }
+    inline Reg sub(Reg a, Reg b) { return _mm_sub_ps(a, b); }
+    inline Reg mul(Reg a, Reg b) { return _mm_mul_ps(a, b); }
+    inline Reg max(Reg a, Reg b) { return _mm_max_ps(a, b); }
+#if defined(__FMA__)
+    inline Reg fma(Reg a, Reg b, Reg c) { return _mm_fmadd_ps(a, b, c); }
+#else
+    inline Reg fma(Reg a, Reg b, Reg c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+#endif
+    inline float reduceAdd(Reg a) {
+        __m128 s = _mm_add_ps(a, _mm_movehl_ps(a, a));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+    inline float reduceMax(Reg a) {
+        __m128 m = _mm_max_ps(a, _mm_movehl_ps(a, a));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+        return _mm_cvtss_f32(m);
+    }
+
+#else
+
+    typedef float Reg;
+    const size_t WIDTH = 1;
+
+    inline Reg zero() { return 0.0f; }
+    inline Reg set1(float x) { return x; }
+    inline Reg load(const float* p) { return *p; }
+    inline void store(float* p, Reg a) { *p = a; }
+    inline Reg add(Reg a, Reg b) { return a + b; }
+    inline Reg sub(Reg a, Reg b) { return a - b; }
+    inline Reg mul(Reg a, Reg b) { return a * b; }
+    inline Reg max(Reg a, Reg b) { return std::max(a, b); }
+    inline Reg fma(Reg a, Reg b, Reg c) { return a * b + c; }
+    inline float reduceAdd(Reg a) { return a; }
+    inline float reduceMax(Reg a) { return a; }
+
+#endif
+
+    // Dot product of two int8 ranges in int32. With AVX2, 16 bytes at a time are widened to
+    // int16 and multiplied pairwise into int32 lanes (madd); the tail stays scalar.
+    inline int32_t dotInt8(const int8_t* a, const int8_t* b, size_t n) {
+        int32_t result = 0;
+        size_t i = 0;
+#if defined(__AVX2__)
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 16 <= n; i += 16) {
+            __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+            __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+        }
+        __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+        result = _mm_cvtsi128_si32(s);
+#endif
+        for (; i < n; ++i) {
+            result += int32_t(a[i]) * b[i];
+        }
+        return result;
+    }
+
+}
+
+#endif // SIMD_H
@@ -0,0 +1,130 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include "thread_pool.h"
+#include "cancellation.h"
+
+// Dependency-driven executor: nodes are added with the ids of the nodes they depend
+// on, and run() launches each node as soon as all of its dependencies have finished.
+// The calling thread executes nodes as well, so a graph run from inside a pool worker
+// (or on a pool without workers) still completes. Once the calling thread's current
+// CancellationToken is cancelled, the remaining nodes are skipped and run() throws
+// OperationCancelled after the nodes already started have finished.
+class TaskGraph {
+public:
+    typedef size_t TaskId;
+
+private:
+    struct Node {
+        std::function<void()> work;
+        std::vector<TaskId> dependents;
+        int numDependencies;
+    };
+
+    struct RunState {
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<TaskId> ready;
+        std::vector<int> pending; // unfinished dependencies per node
+        size_t remaining = 0;
+        size_t activeHelpers = 0;
+        size_t maxHelpers = 0;
+        CancellationToken cancel;
+        bool skipped = false;
+    };
+
+    std::vector<Node> nodes;
+
+    // Called with state.mutex held after new nodes became ready
+    void wakeHelpers(const std::shared_ptr<RunState>& state, ThreadPool& pool) {
+        // The caller takes one ready node itself; helpers cover the rest
+        while (state->activeHelpers < state->maxHelpers && state->activeHelpers + 1 < state->ready.size()) {
+            ++state->activeHelpers;
+            pool.submit([this, state, &pool] { drain(state, pool, false); });
+        }
+        state->changed.notify_all();
+    }
+
+    void drain(const std::shared_ptr<RunState>& state, ThreadPool& pool, bool isCaller) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (true) {
+            if (state->ready.empty()) {
+                if (!isCaller) {
+                    --state->activeHelpers;
+                    return;
+                }
+                state->changed.wait(lock, [&] { return !state->ready.empty() || state->remaining == 0; });
+                if (state->remaining == 0) {
+                    return;
+                }
+            }
+            TaskId id = state->ready.front();
+            state->ready.pop_front();
+            lock.unlock();
+
+            bool cancelled = state->cancel.isCancelled();
+            if (!cancelled) {
+                nodes[id].work();
+            }
+
+            lock.lock();
+            state->skipped = state->skipped || cancelled;
+            for (TaskId dependent : nodes[id].dependents) {
+                if (--state->pending[dependent] == 0) {
+                    state->ready.push_back(dependent);
+                }
+            }
+            --state->remaining;
+            wakeHelpers(state, pool);
+        }
+    }
+
+public:
+    TaskId add(std::function<void()> work, const std::vector<TaskId>& dependencies = {}) {
+        TaskId id = nodes.size();
+        nodes.push_back(Node{std::move(work), {}, static_cast<int>(dependencies.size())});
+        for (TaskId dependency : dependencies) {
+            nodes[dependency].dependents.push_back(id);
+        }
+        return id;
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    // Runs every node once, respecting dependencies; returns when all have finished
+    void run(ThreadPool& pool) {
+        if (nodes.empty()) {
+            return;
+        }
+        auto state = std::make_shared<RunState>();
+        state->remaining = nodes.size();
+        state->maxHelpers = pool.size();
+        state->pending.resize(nodes.size());
+        state->cancel = CancellationToken::current();
+        for (size_t id = 0; id < nodes.size(); ++id) {
+            state->pending[id] = nodes[id].numDependencies;
+            if (state->pending[id] == 0) {
+                state->ready.push_back(id);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            wakeHelpers(state, pool);
+        }
+        drain(state, pool, true);
+        if (state->skipped) {
+            throw OperationCancelled();
+        }
+    }
+};
+
+#endif // TASK_GRAPH_H
@@ -0,0 +1,269 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include "futex.h"
+
+// Fixed-size worker pool shared by all layers.
+// parallelFor splits a range into tiles; the calling thread works on tiles too, so
+// nested parallelFor calls from inside a worker always make progress.
+//
+// A decode step runs dozens of short parallel regions back to back, so waking workers through
+// the kernel for each one would cost more than the work. An idle worker therefore spins on the
+// submission epoch for a while before parking on a futex, and parallelFor's caller spins on
+// its region's finished tiles before parking; both limits are configurable (SpinLimits).
+// Spinning is off by default when the pool has more threads than the machine has hardware
+// threads, where it would only take the core from the thread being waited for.
+class ThreadPool {
+public:
+    struct SpinLimits {
+        std::chrono::microseconds idle{50}; // a worker without tasks, waiting for the next region
+        std::chrono::microseconds join{50}; // parallelFor's caller, waiting for its helpers' tiles
+    };
+
+private:
+    static const int SPINS_PER_CLOCK_READ = 64;
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex; // guards tasks
+    std::atomic<uint64_t> submissions{0}; // epoch watched by idle workers
+    EventCount parked;
+    std::atomic<bool> stopping{false};
+    std::atomic<int64_t> idleSpinNanos;
+    std::atomic<int64_t> joinSpinNanos;
+
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Busy-waits until done() holds, for at most limitNanos; false if it still does not
+    template <typename Condition>
+    static bool spinUntil(Condition done, int64_t limitNanos) {
+        if (done()) {
+            return true;
+        }
+        if (limitNanos <= 0) {
+            return false;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(limitNanos);
+        while (true) {
+            for (int i = 0; i < SPINS_PER_CLOCK_READ; ++i) {
+                cpuRelax();
+                if (done()) {
+                    return true;
+                }
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+        }
+    }
+
+    void workerLoop() {
+        while (true) {
+            // Read before looking at the queue, so a task submitted after the look moves it
+            uint64_t seen = submissions.load(std::memory_order_acquire);
+            std::function<void()> task;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!tasks.empty()) {
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                } else if (stopping.load()) {
+                    return;
+                }
+            }
+            if (task) {
+                task();
+                continue;
+            }
+            auto woken = [this, seen] {
+                return stopping.load(std::memory_order_acquire) || submissions.load(std::memory_order_acquire) != seen;
+            };
+            if (!spinUntil(woken, idleSpinNanos.load(std::memory_order_relaxed))) {
+                parked.waitUntil(woken);
+            }
+        }
+    }
+
+    // State of one parallelFor call, shared with the helper tasks that may outlive it
+    struct ParallelRegion {
+        std::atomic<size_t> nextTile{0};
+        std::atomic<size_t> finishedTiles{0};
+        size_t numTiles = 0;
+        EventCount allFinished;
+    };
+
+    static void runTiles(ParallelRegion& region, size_t begin, size_t end, size_t grain,
+                         const std::function<void(size_t, size_t)>& body) {
+        size_t tile;
+        while ((tile = region.nextTile.fetch_add(1)) < region.numTiles) {
+            size_t tileBegin = begin + tile * grain;
+            body(tileBegin, std::min(end, tileBegin + grain));
+            if (region.finishedTiles.fetch_add(1) + 1 == region.numTiles) {
+                region.allFinished.notifyAll();
+            }
+        }
+    }
+
+public:
+    // numThreads is the number of background workers; the caller is an extra one
+    explicit ThreadPool(int numThreads) : ThreadPool(numThreads, defaultSpinLimits(numThreads)) {}
+
+    ThreadPool(int numThreads, const SpinLimits& spin) {
+        setSpinLimits(spin);
+        for (int i = 0; i < numThreads; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        stopping.store(true);
+        parked.notifyAll();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        submissions.fetch_add(1, std::memory_order_release);
+        parked.notifyAll();
+    }
+
+    int size() const {
+        return workers.size();
+    }
+
+    // Spinning only pays off when every pool thread and the caller have a hardware thread
+    static SpinLimits defaultSpinLimits(int numThreads) {
+        SpinLimits spin;
+        if (numThreads + 1 > static_cast<int>(std::thread::hardware_concurrency())) {
+            spin.idle = spin.join = std::chrono::microseconds(0);
+        }
+        return spin;
+    }
+
+    // May be changed while the pool runs; zero parks right away
+    void setSpinLimits(const SpinLimits& spin) {
+        idleSpinNanos.store(std::chrono::duration_cast<std::chrono::nanoseconds>(spin.idle).count());
+        joinSpinNanos.store(std::chrono::duration_cast<std::chrono::nanoseconds>(spin.join).count());
+    }
+
+    SpinLimits getSpinLimits() const {
+        SpinLimits spin;
+        spin.idle = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(idleSpinNanos.load()));
+        spin.join = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(joinSpinNanos.load()));
+        return spin;
+    }
+
+    // Runs body(tileBegin, tileEnd) over [begin, end) in tiles of grain elements
+    void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body) {
+        if (begin >= end) {
+            return;
+        }
+        grain = std::max<size_t>(grain, 1);
+        size_t numTiles = (end - begin + grain - 1) / grain;
+        if (numTiles == 1 || workers.empty()) {
+            for (size_t tileBegin = begin; tileBegin < end; tileBegin += grain) {
+                body(tileBegin, std::min(end, tileBegin + grain));
+            }
+            return;
+        }
+
+        auto region = std::make_shared<ParallelRegion>();
+        region->numTiles = numTiles;
+        size_t helpers = std::min(numTiles - 1, workers.size());
+        for (size_t i = 0; i < helpers; ++i) {
+            // Helpers that start after every tile is claimed return without touching body
+            submit([region, begin, end, grain, &body] { runTiles(*region, begin, end, grain, body); });
+        }
+        runTiles(*region, begin, end, grain, body);
+
+        auto finished = [&region] { return region->finishedTiles.load() == region->numTiles; };
+        if (!spinUntil(finished, joinSpinNanos.load(std::memory_order_relaxed))) {
+            region->allFinished.waitUntil(finished);
+        }
+    }
+
+    // Runs fn once on every worker and once on the calling thread (e.g. to size
+    // thread-local scratch). Workers that finish wait for the others, so none runs it twice;
+    // for that reason it must not be called from inside a pool task.
+    void forEachThread(const std::function<void()>& fn) {
+        struct Barrier {
+            std::mutex mutex;
+            std::condition_variable changed;
+            size_t arrived = 0;
+        };
+        auto barrier = std::make_shared<Barrier>();
+        size_t numWorkers = workers.size();
+        for (size_t i = 0; i < numWorkers; ++i) {
+            submit([barrier, numWorkers, &fn] {
+                fn();
+                std::unique_lock<std::mutex> lock(barrier->mutex);
+                ++barrier->arrived;
+                barrier->changed.notify_all();
+                barrier->changed.wait(lock, [&] { return barrier->arrived >= numWorkers; });
+            });
+        }
+        fn();
+        std::unique_lock<std::mutex> lock(barrier->mutex);
+        barrier->changed.wait(lock, [&] { return barrier->arrived >= numWorkers; });
+    }
+
+    // Rows per tile for row-wise work over rows of rowWidth floats, so each tile
+    // carries enough work to amortize the dispatch. Narrow rows are capped at MAX_TILE_ROWS
+    // so that a single sequence (100 rows at most in main.cpp) still splits across the pool.
+    static size_t grainForRowWidth(size_t rowWidth) {
+        const size_t TILE_FLOATS = 16384;
+        const size_t MAX_TILE_ROWS = 16;
+        return std::max<size_t>(1, std::min(MAX_TILE_ROWS, TILE_FLOATS / std::max<size_t>(rowWidth, 1)));
+    }
+
+    // Process-wide pool; TRANSFORMER_NUM_THREADS overrides the hardware thread count, and
+    // TRANSFORMER_SPIN_US / TRANSFORMER_JOIN_SPIN_US the idle and join spin limits
+    static ThreadPool& shared() {
+        static const int numThreads = [] {
+            int threads = std::thread::hardware_concurrency();
+            if (const char* env = std::getenv("TRANSFORMER_NUM_THREADS")) {
+                threads = std::atoi(env);
+            }
+            return std::max(threads, 1) - 1;
+        }();
+        static ThreadPool pool(numThreads, [] {
+            SpinLimits spin = defaultSpinLimits(numThreads);
+            if (const char* env = std::getenv("TRANSFORMER_SPIN_US")) {
+                spin.idle = std::chrono::microseconds(std::atol(env));
+            }
+            if (const char* env = std::getenv("TRANSFORMER_JOIN_SPIN_US")) {
+                spin.join = std::chrono::microseconds(std::atol(env));
+            }
+            return spin;
+        }());
+        return pool;
+    }
+};
+
+#endif // THREAD_POOL_H
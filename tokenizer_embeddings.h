@@ -7,6 +7,7 @@
 #include <sstream>
 #include <algorithm>
 #include <cmath>
+#include <stdexcept>
 #include "transformer_types.h"
 
 // Tokenizer class
@@ -35,18 +36,22 @@ public:
         }
     }
 
-    int encode(const std::string& word) {
+    // encode() and decode() only read the vocabulary, so any number of threads may call them
+    // once it is built
+    int encode(const std::string& word) const {
         std::string lowerWord = word;
         std::transform(lowerWord.begin(), lowerWord.end(), lowerWord.begin(), ::tolower);
-        if (wordToIndex.find(lowerWord) != wordToIndex.end()) {
-            return wordToIndex[lowerWord];
+        auto found = wordToIndex.find(lowerWord);
+        if (found != wordToIndex.end()) {
+            return found->second;
         }
         return -1; // Unknown word
     }
 
-    std::string decode(int index) {
-        if (indexToWord.find(index) != indexToWord.end()) {
-            return indexToWord[index];
+    std::string decode(int index) const {
+        auto found = indexToWord.find(index);
+        if (found != indexToWord.end()) {
+            return found->second;
         }
         return "<unk>"; // Unknown index
     }
@@ -59,7 +64,7 @@ public:
 // Embeddings class (Word Embeddings + Positional Encoding)
 class Embeddings {
 private:
-    Matrix wordEmbeddings;
+    WeightMatrix wordEmbeddings;
     Matrix positionalEncodings;
     int embeddingDim;
     int maxSequenceLength;
@@ -78,19 +83,28 @@ private:
     }
 
 public:
-    Embeddings(int vocabSize, int embedDim, int maxSeqLen)
+    Embeddings(int vocabSize, int embedDim, int maxSeqLen,
+               uint64_t key = Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "embeddings"))
         : embeddingDim(embedDim), maxSequenceLength(maxSeqLen) {
         
         // Initialize word embeddings randomly
-        Utils::initializeMatrix(wordEmbeddings, vocabSize, embeddingDim);
+        Utils::initializeMatrix(wordEmbeddings, vocabSize, embeddingDim, key);
 
         // Generate positional encodings
         generatePositionalEncodings();
     }
 
-    // Get embedding for a token at a specific position
+    // Get embedding for a token at a specific position (0 <= position < maxSequenceLength;
+    // longer inputs go through a streaming encoder that restarts positions per window)
     Vector getEmbedding(int tokenIndex, int position) {
-        Vector embedding = wordEmbeddings[tokenIndex];
+        if (tokenIndex < 0 || tokenIndex >= (int)wordEmbeddings.rows()) {
+            throw std::out_of_range("token index " + std::to_string(tokenIndex) + " outside the vocabulary");
+        }
+        if (position < 0 || position >= maxSequenceLength) {
+            throw std::out_of_range("position " + std::to_string(position) + " beyond the maximum sequence length " +
+                                    std::to_string(maxSequenceLength));
+        }
+        Vector embedding(wordEmbeddings[tokenIndex], wordEmbeddings[tokenIndex] + embeddingDim);
         Vector posEncoding = positionalEncodings[position];
         
         // Add word embedding and positional encoding
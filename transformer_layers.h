@@ -3,39 +3,126 @@
 
 #include "transformer_types.h"
 #include "self_attention.h"
+#include "thread_pool.h"
+#include "task_graph.h"
+#include "model_loader.h"
+#include "pooling.h"
+#include <memory>
+#include <limits>
+#include <set>
 
 // Feed-Forward Network
 class FeedForwardNetwork {
 private:
-    Matrix W1, W2; // Weights
+    WeightMatrix W1, W2; // Weights
     Vector B1, B2; // Biases
+    LoraDeltas loraW1, loraW2; // Adapter deltas of W1 and W2
     int inputDim;
     int hiddenDim;
 
-    // ReLU activation function
-    Vector relu(const Vector& input) {
-        Vector output(input.size());
-        for (size_t i = 0; i < input.size(); ++i) {
-            output[i] = std::max(0.0f, input[i]);
-        }
-        return output;
-    }
-
 public:
-    FeedForwardNetwork(int inDim, int hDim) : inputDim(inDim), hiddenDim(hDim) {
-        Utils::initializeMatrix(W1, inputDim, hiddenDim);
-        Utils::initializeMatrix(W2, hiddenDim, inputDim);
+    FeedForwardNetwork(int inDim, int hDim, bool initializeWeights = true) : inputDim(inDim), hiddenDim(hDim) {
+        W1.setShape(inputDim, hiddenDim);
+        W2.setShape(hiddenDim, inputDim);
+        loraW1.setShape(inputDim, hiddenDim);
+        loraW2.setShape(hiddenDim, inputDim);
         B1.assign(hiddenDim, 0.0f);
         B2.assign(inputDim, 0.0f);
+        if (initializeWeights) {
+            this->initializeWeights(Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "ffn"));
+        }
+    }
+
+    void initializeWeights(uint64_t key) {
+        Utils::initializeMatrix(W1, inputDim, hiddenDim, Utils::childKey(key, 0));
+        Utils::initializeMatrix(W2, hiddenDim, inputDim, Utils::childKey(key, 1));
+    }
+
+    const char* bindWeights(const char* cursor) {
+        return W2.bind(W1.bind(cursor));
+    }
+
+    void unbindWeights() {
+        W1.unbind();
+        W2.unbind();
+    }
+
+    // Attaches adapter id to W1 and/or W2 as config.targets says; the factors depend only on key
+    void addAdapter(int id, const LoraConfig& config, uint64_t key) {
+        if (config.targets & LORA_FFN1) {
+            loraW1.initialize(id, config, Utils::childKey(key, 0));
+        }
+        if (config.targets & LORA_FFN2) {
+            loraW2.initialize(id, config, Utils::childKey(key, 1));
+        }
+    }
+
+    void removeAdapter(int id) {
+        loraW1.remove(id);
+        loraW2.remove(id);
     }
 
     Vector forward(const Vector& input) {
-        // Layer 1: input * W1 + B1
-        Vector hidden = Utils::add(Utils::matMul(input, W1), B1);
-        hidden = relu(hidden);
+        // Layer 1: relu(input * W1 + B1)
+        Vector hidden = Utils::matMul(input, W1);
+        Utils::addInPlace(hidden.data(), B1.data(), hiddenDim);
+        Utils::reluInPlace(hidden.data(), hiddenDim);
 
         // Layer 2: hidden * W2 + B2
-        Vector output = Utils::add(Utils::matMul(hidden, W2), B2);
+        Vector output = Utils::matMul(hidden, W2);
+        Utils::addInPlace(output.data(), B2.data(), inputDim);
+        return output;
+    }
+
+    // A tile of rows at once, each with the deltas of its adapter (adapters: one id per row of
+    // input, or empty for the base weights alone)
+    Matrix forward(const Matrix& input, const RowAdapters& adapters) {
+        Matrix hidden(input.size());
+        for (size_t i = 0; i < input.size(); ++i) {
+            hidden[i] = Utils::matMul(input[i], W1);
+        }
+        loraW1.addDelta(input, adapters, 0, input.size(), hidden.data());
+        Matrix output(input.size());
+        for (size_t i = 0; i < input.size(); ++i) {
+            Utils::addInPlace(hidden[i].data(), B1.data(), hiddenDim);
+            Utils::reluInPlace(hidden[i].data(), hiddenDim);
+            output[i] = Utils::matMul(hidden[i], W2);
+            Utils::addInPlace(output[i].data(), B2.data(), inputDim);
+        }
+        loraW2.addDelta(hidden, adapters, 0, hidden.size(), output.data());
+        return output;
+    }
+
+    void collectWeights(std::vector<MemoryRange>& ranges) const {
+        ranges.push_back(MemoryRange{W1.data(), W1.bytes()});
+        ranges.push_back(MemoryRange{W2.data(), W2.bytes()});
+    }
+
+    // Whole batch at once, weight-stationary; bias and ReLU run as epilogues of each
+    // column tile while it is still in cache
+    Matrix forwardWeightStationary(const Matrix& input, const RowAdapters& adapters = {}) {
+        Matrix hidden;
+        if (loraW1.active(adapters)) {
+            // W1's deltas go in before the ReLU, so bias and ReLU wait for them
+            hidden = Utils::matMulWeightStationary(input, W1);
+            loraW1.addDeltaRows(input, adapters, hidden);
+            ThreadPool::shared().parallelFor(0, hidden.size(), ThreadPool::grainForRowWidth(hiddenDim),
+                                             [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    Utils::addInPlace(hidden[i].data(), B1.data(), hiddenDim);
+                    Utils::reluInPlace(hidden[i].data(), hiddenDim);
+                }
+            });
+        } else {
+            hidden = Utils::matMulWeightStationary(input, W1, [this](float* row, size_t n0, size_t n1) {
+                Utils::addInPlace(row + n0, B1.data() + n0, n1 - n0);
+                Utils::reluInPlace(row + n0, n1 - n0);
+            });
+        }
+        Matrix output = Utils::matMulWeightStationary(hidden, W2, [this](float* row, size_t n0, size_t n1) {
+            Utils::addInPlace(row + n0, B2.data() + n0, n1 - n0);
+        });
+        loraW2.addDeltaRows(hidden, adapters, output);
         return output;
     }
 };
@@ -48,40 +135,159 @@ private:
     Vector ln1_gamma, ln1_beta; // LayerNorm for self-attention
     Vector ln2_gamma, ln2_beta; // LayerNorm for FFN
     int embeddingDim;
+    ExecutionMode executionMode;
+
+    // Residual connection + Layer Normalization over all rows: x[i] = LN(x[i] + residual[i])
+    void addNormRows(Matrix& x, const Matrix& residual, const Vector& gamma, const Vector& beta) {
+        ThreadPool::shared().parallelFor(0, x.size(), ThreadPool::grainForRowWidth(embeddingDim),
+                                         [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Utils::addInPlace(x[i].data(), residual[i].data(), embeddingDim);
+                Utils::layerNormInPlace(x[i].data(), gamma.data(), beta.data(), embeddingDim);
+            }
+        });
+    }
+
+    // Weight tiles in the outer loop, all tokens in the inner loop, for every sublayer
+    Matrix forwardWeightStationary(const Matrix& input, const SequenceOffsets& sequences, const RowAdapters& adapters) {
+        Matrix output1 = selfAttention.forwardWeightStationary(input, false, sequences, adapters);
+        addNormRows(output1, input, ln1_gamma, ln1_beta);
+
+        Matrix output2 = ffn.forwardWeightStationary(output1, adapters);
+        addNormRows(output2, output1, ln2_gamma, ln2_beta);
+        return output2;
+    }
 
 public:
-    EncoderLayer(int embedDim, int numHeads, int ffnHiddenDim)
-        : selfAttention(embedDim, numHeads),
-          ffn(embedDim, ffnHiddenDim),
-          embeddingDim(embedDim) {
+    EncoderLayer(int embedDim, int numHeads, int ffnHiddenDim, bool initializeWeights = true)
+        : selfAttention(embedDim, numHeads, false),
+          ffn(embedDim, ffnHiddenDim, false),
+          embeddingDim(embedDim),
+          executionMode(ExecutionMode::TokenTiled) {
         ln1_gamma.assign(embeddingDim, 1.0f);
         ln1_beta.assign(embeddingDim, 0.0f);
         ln2_gamma.assign(embeddingDim, 1.0f);
         ln2_beta.assign(embeddingDim, 0.0f);
+        if (initializeWeights) {
+            this->initializeWeights(Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "encoder_layer"));
+        }
+    }
+
+    void initializeWeights(uint64_t key) {
+        selfAttention.initializeWeights(Utils::childKey(key, 0));
+        ffn.initializeWeights(Utils::childKey(key, 1));
+    }
+
+    // Attaches adapter id to the matrices config.targets names (see LoraDeltas)
+    void addAdapter(int id, const LoraConfig& config, uint64_t key) {
+        selfAttention.addAdapter(id, config, Utils::childKey(key, 0));
+        ffn.addAdapter(id, config, Utils::childKey(key, 1));
     }
 
-    Matrix forward(const Matrix& input) {
+    void removeAdapter(int id) {
+        selfAttention.removeAdapter(id);
+        ffn.removeAdapter(id);
+    }
+
+    // Intermediate results of one layer in a graph run; must outlive the run
+    struct LayerBuffers {
+        KVCache cache;
+        MultiHeadSelfAttention::AttentionBuffers attention;
+        Matrix attnOutput;
+
+        explicit LayerBuffers(KVCache c) : cache(std::move(c)) {}
+    };
+
+    std::unique_ptr<LayerBuffers> createBuffers() const {
+        return std::unique_ptr<LayerBuffers>(new LayerBuffers(selfAttention.createCache()));
+    }
+
+    // Rows per token tile when this layer is run as a task graph; every row costs
+    // O(embeddingDim^2) in the projections
+    size_t graphGrain() const {
+        return ThreadPool::grainForRowWidth(embeddingDim * embeddingDim);
+    }
+
+    // Adds this layer to graph: the attention stages, then one node per token tile doing
+    // Add & Norm, the FFN and the second Add & Norm. inputTiles, mask, sequences and adapters
+    // follow the conventions of MultiHeadSelfAttention::addToGraph (mask makes the layer
+    // causal). With a pooler, each tile's rows go to it and output is left empty. Returns the
+    // node producing each output tile.
+    std::vector<TaskGraph::TaskId> addToGraph(TaskGraph& graph, const Matrix& input,
+                                              const std::vector<TaskGraph::TaskId>& inputTiles, size_t grain,
+                                              bool mask, const SequenceOffsets& sequences, const RowAdapters& adapters,
+                                              LayerBuffers& buffers, Matrix& output, SequencePooler* pooler = nullptr) {
         // Self-Attention Sub-layer
-        Matrix attnOutput = selfAttention.forward(input);
-        
-        // Add & Norm (Residual connection + Layer Normalization)
-        Matrix output1(input.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < input.size(); ++i) {
-            output1[i] = Utils::layerNorm(Utils::add(input[i], attnOutput[i]), ln1_gamma, ln1_beta);
-        }
+        std::vector<TaskGraph::TaskId> attnTiles =
+            selfAttention.addToGraph(graph, input, inputTiles, grain, buffers.cache, mask, sequences, adapters,
+                                     buffers.attention, buffers.attnOutput);
 
-        // Feed-Forward Sub-layer
-        Matrix ffnOutput(input.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < input.size(); ++i) {
-            ffnOutput[i] = ffn.forward(output1[i]);
+        output.assign(pooler ? 0 : input.size(), Vector());
+        std::vector<TaskGraph::TaskId> outputTiles;
+        for (size_t begin = 0, t = 0; begin < input.size(); begin += grain, ++t) {
+            size_t end = std::min(input.size(), begin + grain);
+            outputTiles.push_back(graph.add([this, &input, &buffers, &output, pooler, begin, end] {
+                // Add & Norm (Residual connection + Layer Normalization)
+                Matrix output1(end - begin);
+                for (size_t i = begin; i < end; ++i) {
+                    output1[i - begin] = Utils::add(input[i], buffers.attnOutput[i]);
+                    Utils::layerNormInPlace(output1[i - begin].data(), ln1_gamma.data(), ln1_beta.data(), embeddingDim);
+                }
+
+                // Feed-Forward Sub-layer over the whole tile, then Add & Norm
+                const RowAdapters& adapters = buffers.attention.adapters;
+                Matrix tile = ffn.forward(output1, adapters.empty() ? RowAdapters()
+                                                                    : RowAdapters(adapters.begin() + begin,
+                                                                                  adapters.begin() + end));
+                for (size_t i = begin; i < end; ++i) {
+                    Vector& row = tile[i - begin];
+                    Utils::addInPlace(row.data(), output1[i - begin].data(), embeddingDim);
+                    Utils::layerNormInPlace(row.data(), ln2_gamma.data(), ln2_beta.data(), embeddingDim);
+                    if (!pooler) {
+                        output[i] = std::move(row);
+                    }
+                }
+                if (pooler) {
+                    pooler->addRows(begin, tile);
+                }
+            }, {attnTiles[t]}));
         }
+        return outputTiles;
+    }
 
-        // Add & Norm
-        Matrix output2(input.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < input.size(); ++i) {
-            output2[i] = Utils::layerNorm(Utils::add(output1[i], ffnOutput[i]), ln2_gamma, ln2_beta);
+    void collectWeights(std::vector<MemoryRange>& ranges) const {
+        selfAttention.collectWeights(ranges);
+        ffn.collectWeights(ranges);
+    }
+
+    const char* bindWeights(const char* cursor) {
+        return ffn.bindWeights(selfAttention.bindWeights(cursor));
+    }
+
+    void unbindWeights() {
+        selfAttention.unbindWeights();
+        ffn.unbindWeights();
+    }
+
+    // WeightStationary pays off for batch prefill when the layer's weights exceed L2
+    void setExecutionMode(ExecutionMode mode) {
+        executionMode = mode;
+    }
+
+    ExecutionMode getExecutionMode() const {
+        return executionMode;
+    }
+
+    Matrix forward(const Matrix& input, const SequenceOffsets& sequences = {}, const RowAdapters& adapters = {}) {
+        if (executionMode == ExecutionMode::WeightStationary) {
+            return forwardWeightStationary(input, sequences, adapters);
         }
-        return output2;
+        Matrix output;
+        std::unique_ptr<LayerBuffers> buffers = createBuffers();
+        TaskGraph graph;
+        addToGraph(graph, input, {}, graphGrain(), false, sequences, adapters, *buffers, output);
+        graph.run(ThreadPool::shared());
+        return output;
     }
 };
 
@@ -97,10 +303,10 @@ private:
     int embeddingDim;
 
 public:
-    DecoderLayer(int embedDim, int numHeads, int ffnHiddenDim)
-        : maskedSelfAttention(embedDim, numHeads),
-          encoderDecoderAttention(embedDim, numHeads),
-          ffn(embedDim, ffnHiddenDim),
+    DecoderLayer(int embedDim, int numHeads, int ffnHiddenDim, bool initializeWeights = true)
+        : maskedSelfAttention(embedDim, numHeads, false),
+          encoderDecoderAttention(embedDim, numHeads, false),
+          ffn(embedDim, ffnHiddenDim, false),
           embeddingDim(embedDim) {
         ln1_gamma.assign(embeddingDim, 1.0f);
         ln1_beta.assign(embeddingDim, 0.0f);
@@ -108,17 +314,48 @@ public:
         ln2_beta.assign(embeddingDim, 0.0f);
         ln3_gamma.assign(embeddingDim, 1.0f);
         ln3_beta.assign(embeddingDim, 0.0f);
+        if (initializeWeights) {
+            this->initializeWeights(Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "decoder_layer"));
+        }
+    }
+
+    void initializeWeights(uint64_t key) {
+        maskedSelfAttention.initializeWeights(Utils::childKey(key, 0));
+        encoderDecoderAttention.initializeWeights(Utils::childKey(key, 1));
+        ffn.initializeWeights(Utils::childKey(key, 2));
+    }
+
+    void collectWeights(std::vector<MemoryRange>& ranges) const {
+        maskedSelfAttention.collectWeights(ranges);
+        encoderDecoderAttention.collectWeights(ranges);
+        ffn.collectWeights(ranges);
+    }
+
+    const char* bindWeights(const char* cursor) {
+        cursor = maskedSelfAttention.bindWeights(cursor);
+        return ffn.bindWeights(encoderDecoderAttention.bindWeights(cursor));
+    }
+
+    void unbindWeights() {
+        maskedSelfAttention.unbindWeights();
+        encoderDecoderAttention.unbindWeights();
+        ffn.unbindWeights();
     }
 
     Matrix forward(const Matrix& targetInput, const Matrix& encoderOutput) {
+        ThreadPool& pool = ThreadPool::shared();
+        size_t grain = ThreadPool::grainForRowWidth(embeddingDim);
+
         // Masked Multi-Head Self-Attention Sub-layer
         Matrix maskedAttnOutput = maskedSelfAttention.forward(targetInput, true); // Apply mask
 
         // Add & Norm
-        Matrix output1(targetInput.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < targetInput.size(); ++i) {
-            output1[i] = Utils::layerNorm(Utils::add(targetInput[i], maskedAttnOutput[i]), ln1_gamma, ln1_beta);
-        }
+        Matrix output1(targetInput.size());
+        pool.parallelFor(0, targetInput.size(), grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                output1[i] = Utils::layerNorm(Utils::add(targetInput[i], maskedAttnOutput[i]), ln1_gamma, ln1_beta);
+            }
+        });
 
         // Multi-Head Encoder-Decoder Attention Sub-layer
         // Here, Q comes from output1, K and V come from encoderOutput
@@ -128,45 +365,363 @@ public:
         Matrix encDecAttnOutput = encoderDecoderAttention.forward(output1); // Simplified cross-attention
 
         // Add & Norm
-        Matrix output2(targetInput.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < targetInput.size(); ++i) {
-            output2[i] = Utils::layerNorm(Utils::add(output1[i], encDecAttnOutput[i]), ln2_gamma, ln2_beta);
+        Matrix output2(targetInput.size());
+        pool.parallelFor(0, targetInput.size(), grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                output2[i] = Utils::layerNorm(Utils::add(output1[i], encDecAttnOutput[i]), ln2_gamma, ln2_beta);
+            }
+        });
+
+        // Feed-Forward Sub-layer, then Add & Norm
+        Matrix output3(targetInput.size());
+        pool.parallelFor(0, targetInput.size(), grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                output3[i] = ffn.forward(output2[i]);
+                Utils::addInPlace(output3[i].data(), output2[i].data(), embeddingDim);
+                Utils::layerNormInPlace(output3[i].data(), ln3_gamma.data(), ln3_beta.data(), embeddingDim);
+            }
+        });
+        return output3;
+    }
+};
+
+// Pieces shared by the Encoder and Decoder stacks, over their vector of layers
+namespace LayerStack {
+
+    // Starts pulling layers[l]'s weights towards the cache (no-op past the last layer)
+    template <typename Layer>
+    void prefetchLayer(const std::vector<Layer>& layers, size_t l) {
+        if (l < layers.size()) {
+            std::vector<MemoryRange> ranges;
+            layers[l].collectWeights(ranges);
+            WeightPrefetcher::shared().prefetch(std::move(ranges));
         }
+    }
 
-        // Feed-Forward Sub-layer
-        Matrix ffnOutput(targetInput.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < targetInput.size(); ++i) {
-            ffnOutput[i] = ffn.forward(output2[i]);
+    // Throws unless every weight matrix of layer has memory behind it: a layer built without
+    // weights, or whose streamed block has been released, cannot run outside a stream pass
+    template <typename Layer>
+    void requireWeights(const Layer& layer) {
+        std::vector<MemoryRange> ranges;
+        layer.collectWeights(ranges);
+        for (const MemoryRange& range : ranges) {
+            if (range.data == nullptr) {
+                throw std::logic_error("layer weights are not bound (streamed or not initialized)");
+            }
         }
+    }
 
-        // Add & Norm
-        Matrix output3(targetInput.size(), Vector(embeddingDim));
-        for (size_t i = 0; i < targetInput.size(); ++i) {
-            output3[i] = Utils::layerNorm(Utils::add(output2[i], ffnOutput[i]), ln3_gamma, ln3_beta);
+    // Writes every layer's weights as one block per layer (see WeightFile)
+    template <typename Layer>
+    void saveWeights(const std::vector<Layer>& layers, const std::string& path) {
+        std::vector<std::vector<MemoryRange>> blocks(layers.size());
+        for (size_t l = 0; l < layers.size(); ++l) {
+            requireWeights(layers[l]);
+            layers[l].collectWeights(blocks[l]);
         }
-        return output3;
+        WeightFile::write(path, blocks);
+    }
+
+    // Consumes one pass of a WeightStream. The layer in use is unbound and released however
+    // the pass ends; when it ends early (cancellation, an error) the layers it never reached
+    // are skipped, so the stream is back at layer 0 for the next pass.
+    template <typename Layer>
+    class StreamPass {
+    private:
+        std::vector<Layer>& layers;
+        WeightStream& stream;
+        size_t next;  // first layer not released yet
+        bool bound;   // layers[next] is bound to its block
+
+    public:
+        StreamPass(std::vector<Layer>& streamedLayers, WeightStream& weightStream)
+            : layers(streamedLayers), stream(weightStream), next(0), bound(false) {}
+
+        ~StreamPass() {
+            if (bound) {
+                layers[next].unbindWeights();
+                stream.release(next++);
+            }
+            for (; next < layers.size(); ++next) {
+                stream.skip(next);
+            }
+        }
+
+        StreamPass(const StreamPass&) = delete;
+        StreamPass& operator=(const StreamPass&) = delete;
+
+        Layer& bindNext() {
+            layers[next].bindWeights(stream.acquire(next));
+            bound = true;
+            return layers[next];
+        }
+
+        void releaseCurrent() {
+            layers[next].unbindWeights();
+            bound = false;
+            stream.release(next++);
+        }
+    };
+
+    // Streaming pass: each layer is bound to its block from stream just before
+    // forwardLayer(layer, rows) runs it and unbound before the block is unmapped, so no
+    // layer is left pointing at released memory. Checks the current CancellationToken before
+    // each layer (see StreamPass for what an early exit leaves behind).
+    template <typename Layer, typename Forward>
+    Matrix forwardStreamed(std::vector<Layer>& layers, WeightStream& stream, const Matrix& input,
+                           Forward forwardLayer) {
+        Matrix output = input;
+        StreamPass<Layer> pass(layers, stream);
+        for (size_t l = 0; l < layers.size(); ++l) {
+            CancellationToken::throwIfCurrentCancelled();
+            output = forwardLayer(pass.bindNext(), output);
+            pass.releaseCurrent();
+        }
+        return output;
     }
-};
+
+}
 
 // Encoder
 class Encoder {
 private:
     std::vector<EncoderLayer> layers;
     int numLayers;
+    uint64_t key;
+    std::vector<std::unique_ptr<ReadyGate>> layerReady;
+    std::set<int> adapters; // ids attached to every layer (see addAdapter)
+
+    // Dependencies of layer l's first graph nodes given the nodes producing its input tiles
+    // (empty for the graph input). A layer still being initialized gets a node that waits for
+    // it in front of them, so the graph starts on the layers that are ready and reaches layer
+    // l only once l is usable. That node blocks a pool worker meanwhile, never for long: the
+    // gates are opened by ModelLoader threads, not by pool work.
+    std::vector<TaskGraph::TaskId> gateLayer(TaskGraph& graph, size_t l, const std::vector<TaskGraph::TaskId>& inputTiles,
+                                             size_t numTiles) {
+        if (numTiles == 0 || layerReady[l]->ready()) {
+            layerReady[l]->wait(); // no tile to hang the wait on for an empty input
+            LayerStack::requireWeights(layers[l]);
+            return inputTiles;
+        }
+        // The loader's initializeWeights() binds the layer, so there is nothing to check after
+        ReadyGate* ready = layerReady[l].get();
+        TaskGraph::TaskId opened = graph.add([ready] { ready->wait(); });
+        std::vector<TaskGraph::TaskId> gated(numTiles, opened);
+        for (size_t t = 0; t < inputTiles.size(); ++t) {
+            gated[t] = graph.add([] {}, {inputTiles[t], opened});
+        }
+        return gated;
+    }
+
+    // Runs the first layerCount layers over input. With a pooler, the graph hands the last
+    // layer's tiles to it and the result is empty; the weight-stationary path returns the
+    // rows as usual.
+    Matrix run(const Matrix& input, const SequenceOffsets& sequences, const RowAdapters& rowAdapters,
+               SequencePooler* pooler, size_t layerCount) {
+        layerCount = std::min(layerCount, layers.size());
+        if (layerCount == 0) {
+            return input;
+        }
+        if (layers[0].getExecutionMode() == ExecutionMode::WeightStationary) {
+            Matrix output = input;
+            for (size_t l = 0; l < layerCount; ++l) {
+                CancellationToken::throwIfCurrentCancelled();
+                layerReady[l]->wait();
+                LayerStack::requireWeights(layers[l]);
+                if (l + 1 < layerCount) {
+                    LayerStack::prefetchLayer(layers, l + 1);
+                }
+                output = layers[l].forward(output, sequences, rowAdapters);
+            }
+            return output;
+        }
+        size_t grain = layers[0].graphGrain();
+        size_t numTiles = (input.size() + grain - 1) / grain;
+        std::vector<Matrix> outputs(layerCount);
+        std::vector<std::unique_ptr<EncoderLayer::LayerBuffers>> buffers;
+        std::vector<TaskGraph::TaskId> tiles;
+        TaskGraph graph;
+        const Matrix* layerInput = &input;
+        for (size_t l = 0; l < layerCount; ++l) {
+            tiles = gateLayer(graph, l, tiles, numTiles);
+            buffers.push_back(layers[l].createBuffers());
+            SequencePooler* layerPooler = l + 1 == layerCount ? pooler : nullptr;
+            tiles = layers[l].addToGraph(graph, *layerInput, tiles, grain, false, sequences, rowAdapters,
+                                         *buffers[l], outputs[l], layerPooler);
+            layerInput = &outputs[l];
+        }
+        graph.run(ThreadPool::shared());
+        return outputs.back();
+    }
+
+    // All layers as one task graph over the keys/values kept in state (one cache per layer),
+    // appending input's keys/values to them
+    Matrix runWithState(const Matrix& input, std::vector<std::unique_ptr<EncoderLayer::LayerBuffers>>& state,
+                        bool mask, const SequenceOffsets& sequences, const RowAdapters& rowAdapters) {
+        if (layers.empty()) {
+            return input;
+        }
+        size_t grain = layers[0].graphGrain();
+        size_t numTiles = (input.size() + grain - 1) / grain;
+        std::vector<Matrix> outputs(layers.size());
+        std::vector<TaskGraph::TaskId> tiles;
+        TaskGraph graph;
+        const Matrix* layerInput = &input;
+        for (size_t l = 0; l < layers.size(); ++l) {
+            tiles = gateLayer(graph, l, tiles, numTiles);
+            tiles = layers[l].addToGraph(graph, *layerInput, tiles, grain, mask, sequences, rowAdapters, *state[l],
+                                         outputs[l]);
+            layerInput = &outputs[l];
+        }
+        graph.run(ThreadPool::shared());
+        return outputs.back();
+    }
 
 public:
-    Encoder(int numL, int embedDim, int numHeads, int ffnHiddenDim) : numLayers(numL) {
+    // Layers are initialized in parallel, each from its own key under modelKey, so the weights
+    // are the same whatever the thread count. With initializeWeights false the layers only get
+    // their shapes, for use with a WeightStream or initializeWeightsAsync().
+    Encoder(int numL, int embedDim, int numHeads, int ffnHiddenDim, bool initializeWeights = true,
+            uint64_t modelKey = Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "encoder"))
+        : numLayers(numL), key(modelKey) {
         for (int i = 0; i < numLayers; ++i) {
-            layers.emplace_back(embedDim, numHeads, ffnHiddenDim);
+            layers.emplace_back(embedDim, numHeads, ffnHiddenDim, false);
+            layerReady.emplace_back(new ReadyGate());
+            layerReady.back()->open();
+        }
+        if (initializeWeights) {
+            ThreadPool::shared().parallelFor(0, layers.size(), 1, [this](size_t begin, size_t end) {
+                for (size_t l = begin; l < end; ++l) {
+                    layers[l].initializeWeights(Utils::childKey(key, l));
+                }
+            });
         }
     }
 
-    Matrix forward(const Matrix& input) {
-        Matrix output = input;
+    // Queues one initialization job per layer on loader and returns at once; forward()
+    // waits for each layer only when it gets to it, so the first layers can run while
+    // later ones are still being filled in. For a Encoder built with initializeWeights false.
+    void initializeWeightsAsync(ModelLoader& loader) {
+        for (size_t l = 0; l < layers.size(); ++l) {
+            layerReady[l].reset(new ReadyGate());
+        }
+        for (size_t l = 0; l < layers.size(); ++l) {
+            loader.add([this, l] {
+                layers[l].initializeWeights(Utils::childKey(key, l));
+                layerReady[l]->open();
+            });
+        }
+    }
+
+    void waitUntilReady() {
+        for (auto& ready : layerReady) {
+            ready->wait();
+        }
+    }
+
+    // Writes every layer's weights as one block per layer (see WeightFile)
+    void saveWeights(const std::string& path) const {
+        LayerStack::saveWeights(layers, path);
+    }
+
+    // Streaming form for weights that do not fit in memory: each layer is bound to its block
+    // from stream just before it runs and released right after. Every layer sees the whole
+    // batch at once, so a larger batch amortizes each block's I/O over more tokens.
+    Matrix forward(const Matrix& input, WeightStream& stream) {
+        return LayerStack::forwardStreamed(layers, stream, input, [](EncoderLayer& layer, const Matrix& rows) {
+            return layer.forward(rows);
+        });
+    }
+
+    void setExecutionMode(ExecutionMode mode) {
         for (auto& layer : layers) {
-            output = layer.forward(output);
+            layer.setExecutionMode(mode);
+        }
+    }
+
+    // Attaches a LoRA adapter to every layer, as rank-config.rank deltas of the matrices
+    // config.targets names (see LoraDeltas); the base weights stay as they are and shared. The
+    // factors depend only on the encoder's key and id, like the layers' weights. Replaces an
+    // adapter with the same id. Adding or removing adapters must not overlap a forward pass.
+    void addAdapter(int id, const LoraConfig& config) {
+        if (id == NO_ADAPTER || config.rank <= 0) {
+            throw std::invalid_argument("Encoder: bad adapter id or rank");
+        }
+        uint64_t adapterKey = Utils::childKey(Utils::splitmix64(key ^ 0x6C6F7261ULL), uint32_t(id));
+        ThreadPool::shared().parallelFor(0, layers.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t l = begin; l < end; ++l) {
+                layers[l].addAdapter(id, config, Utils::childKey(adapterKey, l));
+            }
+        });
+        adapters.insert(id);
+    }
+
+    void removeAdapter(int id) {
+        for (auto& layer : layers) {
+            layer.removeAdapter(id);
+        }
+        adapters.erase(id);
+    }
+
+    bool hasAdapter(int id) const {
+        return adapters.count(id) > 0;
+    }
+
+    // Per-layer keys/values carried from one call to the next (see forwardCausal)
+    typedef std::vector<std::unique_ptr<EncoderLayer::LayerBuffers>> StreamState;
+
+    StreamState createStreamState() const {
+        StreamState state;
+        for (const auto& layer : layers) {
+            state.push_back(layer.createBuffers());
+        }
+        return state;
+    }
+
+    // Causal (decoder-only) pass: every row attends only to itself and the rows before it, so
+    // row i depends on tokens 0..i alone and one pass yields the next-token context of every
+    // position. Rows are appended after the tokens state already holds and attend to them too,
+    // so a prefix run once can be continued by later calls. With sequences, input is a packed
+    // batch of continuations of that prefix: each one attends to the prefix and to its own
+    // earlier rows, never to the others (state then holds them all and is not worth
+    // continuing). Always runs as a task graph. rowAdapters as in forward().
+    Matrix forwardCausal(const Matrix& input, StreamState& state, const SequenceOffsets& sequences = {},
+                         const RowAdapters& rowAdapters = {}) {
+        return runWithState(input, state, true, sequences, rowAdapters);
+    }
+
+    // forwardCausal without the mask: rows attend to every token state holds and to every row
+    // of their own sequence. State's tokens (e.g. a query encoded by an earlier call) never
+    // see the rows that follow, so their keys/values are computed once however many packed
+    // sequences then attend to them. State's keys/values keep the adapters of the call that
+    // computed them.
+    Matrix forwardAfterPrefix(const Matrix& input, StreamState& state, const SequenceOffsets& sequences = {},
+                              const RowAdapters& rowAdapters = {}) {
+        return runWithState(input, state, false, sequences, rowAdapters);
+    }
+
+    // All layers go into one task graph linked tile by tile, so the next layer's
+    // projections start on token tiles whose previous-layer output is already done.
+    // In weight-stationary mode each layer instead runs over the whole batch in turn.
+    // With sequences, input is a packed batch of independent sequences (see SequenceOffsets).
+    // Every form honours the calling thread's CancellationToken (see CancellationScope): the
+    // graph checks it before each node, the weight-stationary path before each layer.
+    // A non-empty rowAdapters gives the adapter id of each row of input (see addAdapter and
+    // Utils::adapterRows), so one pass serves sequences of different adapters over the shared
+    // base weights; rows with NO_ADAPTER, or an id that was never added, get the base model.
+    Matrix forward(const Matrix& input, const SequenceOffsets& sequences = {}, const RowAdapters& rowAdapters = {}) {
+        return run(input, sequences, rowAdapters, nullptr, layers.size());
+    }
+
+    // Pooled form: the last layer's rows go to pooler tile by tile (in the task graph) and
+    // no per-token output is returned. Only the first layerCount layers run, so a cheaper,
+    // shallower embedding can be had from the same weights.
+    void forward(const Matrix& input, const SequenceOffsets& sequences, SequencePooler& pooler,
+                 size_t layerCount = std::numeric_limits<size_t>::max(), const RowAdapters& rowAdapters = {}) {
+        Matrix output = run(input, sequences, rowAdapters, &pooler, layerCount);
+        if (!output.empty()) {
+            pooler.addRows(0, output);
         }
-        return output;
     }
 };
 
@@ -175,18 +730,75 @@ class Decoder {
 private:
     std::vector<DecoderLayer> layers;
     int numLayers;
+    uint64_t key;
+    std::vector<std::unique_ptr<ReadyGate>> layerReady;
 
 public:
-    Decoder(int numL, int embedDim, int numHeads, int ffnHiddenDim) : numLayers(numL) {
+    // Layers are initialized in parallel, each from its own key under modelKey, so the weights
+    // are the same whatever the thread count. With initializeWeights false the layers only get
+    // their shapes, for use with a WeightStream or initializeWeightsAsync().
+    Decoder(int numL, int embedDim, int numHeads, int ffnHiddenDim, bool initializeWeights = true,
+            uint64_t modelKey = Utils::componentKey(Utils::DEFAULT_MODEL_SEED, "decoder"))
+        : numLayers(numL), key(modelKey) {
         for (int i = 0; i < numLayers; ++i) {
-            layers.emplace_back(embedDim, numHeads, ffnHiddenDim);
+            layers.emplace_back(embedDim, numHeads, ffnHiddenDim, false);
+            layerReady.emplace_back(new ReadyGate());
+            layerReady.back()->open();
+        }
+        if (initializeWeights) {
+            ThreadPool::shared().parallelFor(0, layers.size(), 1, [this](size_t begin, size_t end) {
+                for (size_t l = begin; l < end; ++l) {
+                    layers[l].initializeWeights(Utils::childKey(key, l));
+                }
+            });
         }
     }
 
+    // Queues one initialization job per layer on loader and returns at once; forward()
+    // waits for each layer only when it gets to it, so the first layers can run while
+    // later ones are still being filled in. For a Decoder built with initializeWeights false.
+    void initializeWeightsAsync(ModelLoader& loader) {
+        for (size_t l = 0; l < layers.size(); ++l) {
+            layerReady[l].reset(new ReadyGate());
+        }
+        for (size_t l = 0; l < layers.size(); ++l) {
+            loader.add([this, l] {
+                layers[l].initializeWeights(Utils::childKey(key, l));
+                layerReady[l]->open();
+            });
+        }
+    }
+
+    void waitUntilReady() {
+        for (auto& ready : layerReady) {
+            ready->wait();
+        }
+    }
+
+    // Writes every layer's weights as one block per layer (see WeightFile)
+    void saveWeights(const std::string& path) const {
+        LayerStack::saveWeights(layers, path);
+    }
+
+    // Streaming form for weights that do not fit in memory: each layer is bound to its block
+    // from stream just before it runs and released right after. Every layer sees the whole
+    // batch at once, so a larger batch amortizes each block's I/O over more tokens.
+    Matrix forward(const Matrix& targetInput, const Matrix& encoderOutput, WeightStream& stream) {
+        return LayerStack::forwardStreamed(layers, stream, targetInput,
+                                           [&encoderOutput](DecoderLayer& layer, const Matrix& rows) {
+            return layer.forward(rows, encoderOutput);
+        });
+    }
+
+    // Layer l + 1's weights are prefetched in the background while layer l computes
     Matrix forward(const Matrix& targetInput, const Matrix& encoderOutput) {
         Matrix output = targetInput;
-        for (auto& layer : layers) {
-            output = layer.forward(output, encoderOutput);
+        for (size_t l = 0; l < layers.size(); ++l) {
+            CancellationToken::throwIfCurrentCancelled();
+            layerReady[l]->wait();
+            LayerStack::requireWeights(layers[l]);
+            LayerStack::prefetchLayer(layers, l + 1);
+            output = layers[l].forward(output, encoderOutput);
         }
         return output;
     }
@@ -5,34 +5,302 @@
 #include <cmath>
 #include <numeric>
 #include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "simd.h"
+#include "thread_pool.h"
+#include "memory_arena.h"
+#include "weight_stream.h"
 
 // Definiciones de tipos para mayor claridad
 typedef std::vector<float> Vector;
 typedef std::vector<std::vector<float>> Matrix;
 
+// Matriz de pesos contigua (fila mayor) reservada en la arena de páginas grandes.
+// Las copias comparten memoria por recuento de referencias: el bloque vuelve a la arena
+// cuando desaparece la última copia que lo usa.
+class WeightMatrix {
+private:
+    float* values;
+    size_t numRows;
+    size_t numCols;
+    std::shared_ptr<float> storage; // bloque propio en la arena; vacío si no hay o tras bind()
+
+public:
+    WeightMatrix() : values(nullptr), numRows(0), numCols(0) {}
+
+    // Solo la forma; la memoria llega después con allocate() o bind()
+    void setShape(size_t rows, size_t cols) {
+        numRows = rows;
+        numCols = cols;
+        values = nullptr;
+        storage.reset();
+    }
+
+    void allocate(size_t rows, size_t cols) {
+        setShape(rows, cols);
+        size_t size = bytes();
+        values = static_cast<float*>(HugePageArena::weights().allocate(size));
+        storage.reset(values, [size](float* block) { HugePageArena::weights().release(block, size); });
+    }
+
+    // Apunta a memoria externa de solo lectura (un bloque de un fichero de pesos) a partir de
+    // cursor, alineado como en WeightFile; devuelve el cursor tras la matriz
+    const char* bind(const char* cursor) {
+        uintptr_t aligned = WeightFile::alignUp(reinterpret_cast<uintptr_t>(cursor), WeightFile::MATRIX_ALIGNMENT);
+        storage.reset();
+        values = reinterpret_cast<float*>(aligned);
+        return reinterpret_cast<const char*>(aligned) + bytes();
+    }
+
+    // Suelta la memoria (propia o externa); la forma se conserva para un bind() posterior
+    void unbind() {
+        storage.reset();
+        values = nullptr;
+    }
+
+    float* operator[](size_t row) { return values + row * numCols; }
+    const float* operator[](size_t row) const { return values + row * numCols; }
+    float* data() { return values; }
+    const float* data() const { return values; }
+    size_t rows() const { return numRows; }
+    size_t cols() const { return numCols; }
+    size_t bytes() const { return numRows * numCols * sizeof(float); }
+};
+
+// Orden de recorrido de una capa sobre un lote de tokens:
+// TokenTiled recorre los tokens por bloques y cada token lee todos los pesos;
+// WeightStationary recorre los pesos por bloques y cada bloque se aplica a todos los tokens.
+enum class ExecutionMode { TokenTiled, WeightStationary };
+
+// Lote de secuencias empaquetadas fila tras fila en una sola Matrix: la secuencia s ocupa las
+// filas [sequences[s], sequences[s + 1]), así que hay un elemento más que secuencias.
+// Vacío significa que todas las filas forman una única secuencia.
+typedef std::vector<size_t> SequenceOffsets;
+
 // Funciones de utilidad para operaciones matriciales y vectoriales
 namespace Utils {
 
-    // Producto punto de dos vectores
-    float dotProduct(const Vector& a, const Vector& b) {
-        float result = 0.0;
-        for (size_t i = 0; i < a.size(); ++i) {
+    // Primitivas in-place sobre rangos contiguos (puntero + longitud), vectorizadas con Simd.
+    // Las versiones que devuelven Vector más abajo se apoyan en ellas.
+
+    // Producto punto de dos rangos de n elementos
+    float dotProduct(const float* a, const float* b, size_t n) {
+        Simd::Reg acc = Simd::zero();
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            acc = Simd::fma(Simd::load(a + i), Simd::load(b + i), acc);
+        }
+        float result = Simd::reduceAdd(acc);
+        for (; i < n; ++i) {
             result += a[i] * b[i];
         }
         return result;
     }
 
-    // Multiplicación de vector por matriz (vector * matrix)
+    // Distancia euclídea al cuadrado entre dos rangos de n elementos
+    float squaredDistance(const float* a, const float* b, size_t n) {
+        Simd::Reg acc = Simd::zero();
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::Reg diff = Simd::sub(Simd::load(a + i), Simd::load(b + i));
+            acc = Simd::fma(diff, diff, acc);
+        }
+        float result = Simd::reduceAdd(acc);
+        for (; i < n; ++i) {
+            result += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+        return result;
+    }
+
+    // y += alpha * x
+    void axpy(float* y, float alpha, const float* x, size_t n) {
+        Simd::Reg va = Simd::set1(alpha);
+        size_t vectorEnd = n - n % Simd::WIDTH;
+        size_t i = 0;
+        for (; i < vectorEnd; i += Simd::WIDTH) {
+            Simd::store(y + i, Simd::fma(va, Simd::load(x + i), Simd::load(y + i)));
+        }
+        for (; i < n; ++i) {
+            y[i] += alpha * x[i];
+        }
+    }
+
+    // a += b
+    void addInPlace(float* a, const float* b, size_t n) {
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::store(a + i, Simd::add(Simd::load(a + i), Simd::load(b + i)));
+        }
+        for (; i < n; ++i) {
+            a[i] += b[i];
+        }
+    }
+
+    // a = max(a, b)
+    void maxInPlace(float* a, const float* b, size_t n) {
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::store(a + i, Simd::max(Simd::load(a + i), Simd::load(b + i)));
+        }
+        for (; i < n; ++i) {
+            a[i] = std::max(a[i], b[i]);
+        }
+    }
+
+    // a *= s
+    void scaleInPlace(float* a, float s, size_t n) {
+        Simd::Reg vs = Simd::set1(s);
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::store(a + i, Simd::mul(Simd::load(a + i), vs));
+        }
+        for (; i < n; ++i) {
+            a[i] *= s;
+        }
+    }
+
+    // a = max(0, a)
+    void reluInPlace(float* a, size_t n) {
+        Simd::Reg zero = Simd::zero();
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::store(a + i, Simd::max(Simd::load(a + i), zero));
+        }
+        for (; i < n; ++i) {
+            a[i] = std::max(0.0f, a[i]);
+        }
+    }
+
+    float sum(const float* a, size_t n) {
+        Simd::Reg acc = Simd::zero();
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            acc = Simd::add(acc, Simd::load(a + i));
+        }
+        float result = Simd::reduceAdd(acc);
+        for (; i < n; ++i) {
+            result += a[i];
+        }
+        return result;
+    }
+
+    float maxElement(const float* a, size_t n) {
+        float result = a[0];
+        size_t i = 0;
+        if (n >= Simd::WIDTH) {
+            Simd::Reg acc = Simd::load(a);
+            for (i = Simd::WIDTH; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+                acc = Simd::max(acc, Simd::load(a + i));
+            }
+            result = Simd::reduceMax(acc);
+        }
+        for (; i < n; ++i) {
+            result = std::max(result, a[i]);
+        }
+        return result;
+    }
+
+    // Softmax in-place (la exponencial sigue siendo escalar)
+    void softmaxInPlace(float* a, size_t n) {
+        float maxScore = maxElement(a, n);
+        for (size_t i = 0; i < n; ++i) {
+            a[i] = std::exp(a[i] - maxScore);
+        }
+        scaleInPlace(a, 1.0f / sum(a, n), n);
+    }
+
+    // Normalización de capa in-place
+    void layerNormInPlace(float* a, const float* gamma, const float* beta, size_t n, float epsilon = 1e-5) {
+        float mean = sum(a, n) / n;
+        Simd::Reg vmean = Simd::set1(mean);
+        Simd::Reg acc = Simd::zero();
+        size_t i = 0;
+        for (; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::Reg centered = Simd::sub(Simd::load(a + i), vmean);
+            acc = Simd::fma(centered, centered, acc);
+        }
+        float variance = Simd::reduceAdd(acc);
+        for (; i < n; ++i) {
+            variance += (a[i] - mean) * (a[i] - mean);
+        }
+        variance /= n;
+
+        float invStd = 1.0f / std::sqrt(variance + epsilon);
+        Simd::Reg vinv = Simd::set1(invStd);
+        for (i = 0; i + Simd::WIDTH <= n; i += Simd::WIDTH) {
+            Simd::Reg normalized = Simd::mul(Simd::sub(Simd::load(a + i), vmean), vinv);
+            Simd::store(a + i, Simd::fma(Simd::load(gamma + i), normalized, Simd::load(beta + i)));
+        }
+        for (; i < n; ++i) {
+            a[i] = gamma[i] * (a[i] - mean) * invStd + beta[i];
+        }
+    }
+
+    // Producto punto de dos vectores
+    float dotProduct(const Vector& a, const Vector& b) {
+        return dotProduct(a.data(), b.data(), a.size());
+    }
+
+    // Multiplicación de vector por matriz (vector * matrix), acumulando fila a fila
     Vector matMul(const Vector& vec, const Matrix& matrix) {
         Vector result(matrix[0].size(), 0.0);
-        for (size_t i = 0; i < matrix[0].size(); ++i) {
-            for (size_t j = 0; j < vec.size(); ++j) {
-                result[i] += vec[j] * matrix[j][i];
-            }
+        for (size_t j = 0; j < vec.size(); ++j) {
+            axpy(result.data(), vec[j], matrix[j].data(), result.size());
         }
         return result;
     }
 
+    // Multiplicación de vector por matriz de pesos (vector * weights)
+    Vector matMul(const Vector& vec, const WeightMatrix& weights) {
+        Vector result(weights.cols(), 0.0);
+        for (size_t j = 0; j < vec.size(); ++j) {
+            axpy(result.data(), vec[j], weights[j], result.size());
+        }
+        return result;
+    }
+
+    // Bloque de pesos (filas x columnas) del recorrido weight-stationary; 64 x 64 floats = 16 KB
+    const size_t WEIGHT_TILE = 64;
+
+    // Columnas [n0, n1) de output = input * matrix en orden weight-stationary: las filas de
+    // matrix se recorren en bloques de WEIGHT_TILE y cada bloque se aplica a todos los tokens
+    // antes de pasar al siguiente, así cada bloque de pesos se lee de memoria una vez por lote
+    // y no una vez por token. Las filas de output deben tener ya su tamaño.
+    void matMulColumnsWeightStationary(const Matrix& input, const WeightMatrix& matrix, Matrix& output, size_t n0, size_t n1) {
+        for (auto& row : output) {
+            std::fill(row.begin() + n0, row.begin() + n1, 0.0f);
+        }
+        for (size_t k0 = 0; k0 < matrix.rows(); k0 += WEIGHT_TILE) {
+            size_t k1 = std::min(matrix.rows(), k0 + WEIGHT_TILE);
+            for (size_t i = 0; i < input.size(); ++i) {
+                for (size_t k = k0; k < k1; ++k) {
+                    axpy(output[i].data() + n0, input[i][k], matrix[k] + n0, n1 - n0);
+                }
+            }
+        }
+    }
+
+    // input * matrix en orden weight-stationary, repartiendo bloques de columnas en el pool.
+    // epilogue(row, n0, n1) se aplica a cada fila sobre el bloque recién calculado, mientras
+    // sigue en caché (sesgo, activación...).
+    template <typename Epilogue>
+    Matrix matMulWeightStationary(const Matrix& input, const WeightMatrix& matrix, Epilogue epilogue) {
+        Matrix output(input.size(), Vector(matrix.cols()));
+        ThreadPool::shared().parallelFor(0, matrix.cols(), WEIGHT_TILE, [&](size_t n0, size_t n1) {
+            matMulColumnsWeightStationary(input, matrix, output, n0, n1);
+            for (auto& row : output) {
+                epilogue(row.data(), n0, n1);
+            }
+        });
+        return output;
+    }
+
+    Matrix matMulWeightStationary(const Matrix& input, const WeightMatrix& matrix) {
+        return matMulWeightStationary(input, matrix, [](float*, size_t, size_t) {});
+    }
+
     // Multiplicación de matriz por vector (matrix * vector)
     Vector matMul(const Matrix& matrix, const Vector& vec) {
         Vector result(matrix.size(), 0.0);
@@ -46,24 +314,32 @@ namespace Utils {
 
     // Suma de dos vectores
     Vector add(const Vector& a, const Vector& b) {
-        Vector result(a.size());
-        for (size_t i = 0; i < a.size(); ++i) {
-            result[i] = a[i] + b[i];
-        }
+        Vector result = a;
+        addInPlace(result.data(), b.data(), result.size());
         return result;
     }
 
     // Softmax
     Vector softmax(const Vector& scores) {
-        Vector expScores;
-        float maxScore = *std::max_element(scores.begin(), scores.end());
+        Vector result = scores;
+        softmaxInPlace(result.data(), result.size());
+        return result;
+    }
+
+    // Log-softmax estable: scores[i] - max - log(sum(exp(scores - max)))
+    Vector logSoftmax(const Vector& scores) {
+        if (scores.empty()) {
+            return Vector();
+        }
+        float largest = *std::max_element(scores.begin(), scores.end());
+        double sum = 0.0;
         for (float score : scores) {
-            expScores.push_back(std::exp(score - maxScore));
+            sum += std::exp(score - largest);
         }
-        float sumExpScores = std::accumulate(expScores.begin(), expScores.end(), 0.0f);
+        float logSum = largest + static_cast<float>(std::log(sum));
         Vector result(scores.size());
         for (size_t i = 0; i < scores.size(); ++i) {
-            result[i] = expScores[i] / sumExpScores;
+            result[i] = scores[i] - logSum;
         }
         return result;
     }
@@ -78,19 +354,51 @@ namespace Utils {
         }
     }
 
-    // Normalización de capa (Layer Normalization)
-    Vector layerNorm(const Vector& input, const Vector& gamma, const Vector& beta, float epsilon = 1e-5) {
-        float mean = std::accumulate(input.begin(), input.end(), 0.0f) / input.size();
-        float variance = 0.0f;
-        for (float val : input) {
-            variance += (val - mean) * (val - mean);
-        }
-        variance /= input.size();
+    // Generador basado en contador (splitmix64): el valor depende solo de la entrada,
+    // así los pesos no dependen del orden ni del hilo en que se inicializan
+    uint64_t splitmix64(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
 
-        Vector output(input.size());
-        for (size_t i = 0; i < input.size(); ++i) {
-            output[i] = gamma[i] * (input[i] - mean) / std::sqrt(variance + epsilon) + beta[i];
+    // Clave del hijo index (capa, tensor...) de un nodo del modelo
+    uint64_t childKey(uint64_t parent, uint64_t index) {
+        return splitmix64(parent ^ splitmix64(index));
+    }
+
+    // Semilla de un modelo cuando no se da otra
+    const uint64_t DEFAULT_MODEL_SEED = 0x7472616E73666F72ULL;
+
+    // Clave de un componente raíz a partir de la semilla del modelo y de su ruta ("encoder",
+    // "embeddings"...): no depende de cuántos componentes se construyeron antes ni en qué orden
+    uint64_t componentKey(uint64_t seed, const std::string& path) {
+        uint64_t key = seed;
+        for (unsigned char c : path) {
+            key = childKey(key, c);
         }
+        return key;
+    }
+
+    // Inicialización de una matriz de pesos: el elemento e recibe un valor entre -0.5 y 0.5
+    // derivado de (key, e), con las filas repartidas en el pool
+    void initializeMatrix(WeightMatrix& matrix, int rows, int cols, uint64_t key) {
+        matrix.allocate(rows, cols);
+        ThreadPool::shared().parallelFor(0, rows, ThreadPool::grainForRowWidth(cols), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                for (int j = 0; j < cols; ++j) {
+                    uint64_t bits = splitmix64(key + i * cols + j) >> 40; // 24 bits
+                    matrix[i][j] = bits * (1.0f / (1 << 24)) - 0.5f;
+                }
+            }
+        });
+    }
+
+    // Normalización de capa (Layer Normalization)
+    Vector layerNorm(const Vector& input, const Vector& gamma, const Vector& beta, float epsilon = 1e-5) {
+        Vector output = input;
+        layerNormInPlace(output.data(), gamma.data(), beta.data(), output.size(), epsilon);
         return output;
     }
 
@@ -0,0 +1,242 @@
+#ifndef WEIGHT_STREAM_H
+#define WEIGHT_STREAM_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "prefetch.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// On-disk layout shared by the writer and WeightStream:
+//   header: "TFWS" | uint32 version | uint64 numLayers | numLayers x (uint64 offset, uint64 bytes)
+//   one block per layer, starting at a multiple of LAYER_ALIGNMENT; inside a block each
+//   weight matrix starts at a multiple of MATRIX_ALIGNMENT, in collectWeights() order.
+namespace WeightFile {
+
+    const uint32_t VERSION = 1;
+    const size_t LAYER_ALIGNMENT = size_t(64) << 10; // mmap offsets must be page aligned
+    const size_t MATRIX_ALIGNMENT = 64;
+
+    size_t alignUp(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    size_t blockBytes(const std::vector<MemoryRange>& matrices) {
+        size_t bytes = 0;
+        for (const MemoryRange& matrix : matrices) {
+            bytes = alignUp(bytes, MATRIX_ALIGNMENT) + matrix.bytes;
+        }
+        return bytes;
+    }
+
+    // layers[l] lists layer l's weight matrices
+    void write(const std::string& path, const std::vector<std::vector<MemoryRange>>& layers) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("cannot write weight file " + path);
+        }
+        uint64_t numLayers = layers.size();
+        size_t offset = alignUp(4 + sizeof(uint32_t) + sizeof(uint64_t) * (1 + 2 * numLayers), LAYER_ALIGNMENT);
+        std::vector<uint64_t> table;
+        for (const auto& layer : layers) {
+            table.push_back(offset);
+            table.push_back(blockBytes(layer));
+            offset = alignUp(offset + blockBytes(layer), LAYER_ALIGNMENT);
+        }
+        out.write("TFWS", 4);
+        out.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+        out.write(reinterpret_cast<const char*>(&numLayers), sizeof(numLayers));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(uint64_t));
+
+        const char zeros[MATRIX_ALIGNMENT] = {};
+        for (size_t l = 0; l < layers.size(); ++l) {
+            out.seekp(table[2 * l]);
+            size_t written = 0;
+            for (const MemoryRange& matrix : layers[l]) {
+                size_t padding = alignUp(written, MATRIX_ALIGNMENT) - written;
+                out.write(zeros, padding);
+                out.write(static_cast<const char*>(matrix.data), matrix.bytes);
+                written += padding + matrix.bytes;
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("error writing weight file " + path);
+        }
+    }
+
+}
+
+// Streams layer weight blocks from a weight file for models that do not fit in memory.
+// Layers are consumed in order, wrapping around for the next pass: acquire(l) returns
+// layer l's block (mapped read-only from the file) and release(l) unmaps it and drops
+// its pages from the page cache. An I/O thread maps and faults in the blocks ahead of
+// the consumer, as many as the resident-memory budget allows.
+class WeightStream {
+private:
+    int fd;
+    std::vector<size_t> offsets;
+    std::vector<size_t> sizes;
+    size_t lookahead; // layers that may be resident besides the one in use
+
+    std::thread io;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<const char*> mapped; // per layer, null when not mapped
+    uint64_t loadedSteps;   // layer blocks mapped so far (layer = step % numLayers)
+    uint64_t releasedSteps; // layer blocks released so far
+    bool stopping;
+
+    const char* mapLayer(size_t layer) {
+#if defined(__linux__)
+        void* base = mmap(nullptr, sizes[layer], PROT_READ, MAP_SHARED, fd, offsets[layer]);
+        if (base == MAP_FAILED) {
+            return nullptr;
+        }
+        madvise(base, sizes[layer], MADV_WILLNEED);
+        // Fault every page in here, on the I/O thread, rather than in the compute kernels
+        const volatile char* bytes = static_cast<const char*>(base);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < sizes[layer]; offset += pageSize) {
+            (void)bytes[offset];
+        }
+        return static_cast<const char*>(base);
+#else
+        (void)layer;
+        return nullptr;
+#endif
+    }
+
+    void ioLoop() {
+        while (true) {
+            size_t layer;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return stopping || loadedSteps <= releasedSteps + lookahead; });
+                if (stopping) {
+                    return;
+                }
+                layer = loadedSteps % offsets.size();
+            }
+            const char* base = mapLayer(layer);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                mapped[layer] = base;
+                ++loadedSteps;
+            }
+            changed.notify_all();
+        }
+    }
+
+public:
+    // residentBudgetBytes bounds the weight bytes mapped at once (never less than one layer)
+    WeightStream(const std::string& path, size_t residentBudgetBytes)
+        : fd(-1), lookahead(0), loadedSteps(0), releasedSteps(0), stopping(false) {
+#if defined(__linux__)
+        fd = open(path.c_str(), O_RDONLY);
+#endif
+        std::ifstream in(path, std::ios::binary);
+        char magic[4];
+        uint32_t version = 0;
+        uint64_t numLayers = 0;
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        in.read(reinterpret_cast<char*>(&numLayers), sizeof(numLayers));
+        if (fd < 0 || !in || std::memcmp(magic, "TFWS", 4) != 0 || version != WeightFile::VERSION || numLayers == 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("cannot stream weight file " + path);
+        }
+        size_t largest = 0;
+        for (uint64_t l = 0; l < numLayers; ++l) {
+            uint64_t entry[2];
+            in.read(reinterpret_cast<char*>(entry), sizeof(entry));
+            offsets.push_back(entry[0]);
+            sizes.push_back(entry[1]);
+            largest = std::max<size_t>(largest, entry[1]);
+        }
+        lookahead = residentBudgetBytes / std::max<size_t>(largest, 1);
+        lookahead = lookahead > 0 ? std::min<size_t>(lookahead - 1, numLayers - 1) : 0;
+        mapped.assign(numLayers, nullptr);
+        io = std::thread([this] { ioLoop(); });
+    }
+
+    ~WeightStream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        io.join();
+#if defined(__linux__)
+        for (size_t l = 0; l < mapped.size(); ++l) {
+            if (mapped[l] != nullptr) {
+                munmap(const_cast<char*>(mapped[l]), sizes[l]);
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    WeightStream(const WeightStream&) = delete;
+    WeightStream& operator=(const WeightStream&) = delete;
+
+    size_t numLayers() const {
+        return offsets.size();
+    }
+
+    // Blocks until layer's block (the next one in streaming order) is resident
+    const char* acquire(size_t layer) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (layer != releasedSteps % offsets.size()) {
+            throw std::logic_error("weight stream layers must be consumed in order");
+        }
+        changed.wait(lock, [this] { return loadedSteps > releasedSteps; });
+        if (mapped[layer] == nullptr) {
+            throw std::runtime_error("cannot map weight block");
+        }
+        return mapped[layer];
+    }
+
+    void release(size_t layer) {
+        const char* base;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            base = mapped[layer];
+            mapped[layer] = nullptr;
+            ++releasedSteps;
+        }
+#if defined(__linux__)
+        if (base != nullptr) {
+            madvise(const_cast<char*>(base), sizes[layer], MADV_DONTNEED);
+            munmap(const_cast<char*>(base), sizes[layer]);
+        }
+        posix_fadvise(fd, offsets[layer], sizes[layer], POSIX_FADV_DONTNEED);
+#endif
+        changed.notify_all();
+    }
+
+    // Consumes layer (the next one in streaming order) without using it, for a pass that stops
+    // early: it waits for the block like acquire() and releases it, never throwing, so the
+    // next pass still starts at layer 0
+    void skip(size_t layer) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return loadedSteps > releasedSteps; });
+        }
+        release(layer);
+    }
+};
+
+#endif // WEIGHT_STREAM_H